@@ -20,6 +20,10 @@
  * molt. If not, see http://www.gnu.org/licenses/
  */
 
+/* C */
+#include <errno.h>
+#include <sys/stat.h>
+
 /* glib */
 #include <glib-2.0/glib.h>
 
@@ -32,6 +36,7 @@ extern GHashTable *new_names;
 extern gint        nb_conflicts;
 extern gint        nb_two_steps;
 
+static gboolean file_exists (const path_t *path);
 static void     old_name_not_available (action_t *action);
 static gboolean ensure_new_name_free (action_t *action);
 static void     set_conflict_FS (action_t *action);
@@ -39,6 +44,16 @@ static gboolean resolve_conflict_FS (action_t *action, action_t *action_pending,
                                      action_t *action_for);
 
 
+static gboolean
+file_exists (const path_t *path)
+{
+    struct stat st;
+    
+    /* we don't follow symlinks: a broken one is still a file in the way. And
+     * if we can't tell, we'd rather assume it's there than overwrite it */
+    return path_lstat (path, &st) == 0 || (errno != ENOENT && errno != ENOTDIR);
+}
+
 static void
 old_name_not_available (action_t *action)
 {
@@ -51,12 +66,12 @@ old_name_not_available (action_t *action)
      * from being marked conflict or conflict-FS. Which means we know that any
      * action that wanted to get this name was either going to (be renamed), or
      * in conflict, but couldn't already be in conflict-FS */
-    a = g_hash_table_lookup (new_names, (gpointer) action->file);
+    a = g_hash_table_lookup (new_names, (gpointer) &action->file);
     if (a && !(a->state & ST_CONFLICT))
     {
-        debug (LEVEL_VERBOSE, "action for %s wanted to take that name (%s), "
+        debug (LEVEL_VERBOSE, "action for %s/%s wanted to take that name (%s/%s), "
                 "setting it to conflict-FS\n",
-                a->file, action->file);
+                PATH_ARGS (&a->file), PATH_ARGS (&action->file));
         if (a->state & ST_TWO_STEPS)
         {
             --nb_two_steps;
@@ -76,11 +91,11 @@ ensure_new_name_free (action_t *action)
     action_t *a;
     
     /* is there already an action for this new name? */
-    a = g_hash_table_lookup (new_names, (gpointer) action->new_name);
+    a = g_hash_table_lookup (new_names, (gpointer) &action->new_file);
     if (a && a != action)
     {
-        debug (LEVEL_DEBUG, "new name (%s) already reserved, setting up conflict\n",
-               action->new_name);
+        debug (LEVEL_DEBUG, "new name (%s/%s) already reserved, setting up conflict\n",
+               PATH_ARGS (&action->new_file));
         
         /* mark action in conflict */
         action->state |= ST_CONFLICT;
@@ -90,8 +105,8 @@ ensure_new_name_free (action_t *action)
         if (!(a->state & ST_CONFLICT))
         {
             /* nope, so we need to set it in conflict as well */
-            debug (LEVEL_VERBOSE, "also marking conflict for action for %s\n",
-                   a->file);
+            debug (LEVEL_VERBOSE, "also marking conflict for action for %s/%s\n",
+                   PATH_ARGS (&a->file));
             a->state |= ST_CONFLICT;
             if (!(a->state & ST_CONFLICT_FS))
             {
@@ -117,7 +132,7 @@ ensure_new_name_free (action_t *action)
     }
     else
     {
-        debug (LEVEL_DEBUG, "new name (%s) is free\n", action->new_name);
+        debug (LEVEL_DEBUG, "new name (%s/%s) is free\n", PATH_ARGS (&action->new_file));
         /* new-name is free (can be marked to-rename/conflict-FS) */
         return TRUE;
     }
@@ -126,7 +141,7 @@ ensure_new_name_free (action_t *action)
 static void
 set_conflict_FS (action_t *action)
 {
-    debug (LEVEL_DEBUG, "-> set_conflict_FS (%s)\n", action->file);
+    debug (LEVEL_DEBUG, "-> set_conflict_FS (%s/%s)\n", PATH_ARGS (&action->file));
     
     /* make sure the new name is not already taken (i.e. that another action
      * isn't already trying to get it -- this does NOT check if an action
@@ -134,7 +149,7 @@ set_conflict_FS (action_t *action)
     if (!ensure_new_name_free (action))
     {
         /* action was marked conflict, we're done here */
-        debug (LEVEL_VERBOSE, "<- set_conflict_FS (%s)\n", action->file);
+        debug (LEVEL_VERBOSE, "<- set_conflict_FS (%s/%s)\n", PATH_ARGS (&action->file));
         return;
     }
     
@@ -146,13 +161,13 @@ set_conflict_FS (action_t *action)
      * failed) we need to take it - that way we'll get updated if the
      * conflict-FS gets resolved, or if another action also wants that name */
     debug (LEVEL_VERBOSE, "adding action to list of new names\n");
-    g_hash_table_insert (new_names, (gpointer) action->new_name,
+    g_hash_table_insert (new_names, (gpointer) &action->new_file,
                          (gpointer) action);
     
     /* old name is not available (anymore), make sure it's dealt with */
     old_name_not_available (action);
     
-    debug (LEVEL_VERBOSE, "<- set_conflict_FS (%s)\n", action->file);
+    debug (LEVEL_VERBOSE, "<- set_conflict_FS (%s/%s)\n", PATH_ARGS (&action->file));
 }
 
 static gboolean
@@ -160,24 +175,24 @@ resolve_conflict_FS (action_t *action, action_t *action_pending, action_t *actio
 {
     action_t *a;
     
-    debug (LEVEL_DEBUG, "-> resolve_conflict_FS (%s, pending: %s, for: %s)\n",
-           action->file, action_pending->file, action_for->file);
+    debug (LEVEL_DEBUG, "-> resolve_conflict_FS (%s/%s, pending: %s/%s, for: %s/%s)\n",
+           PATH_ARGS (&action->file), PATH_ARGS (&action_pending->file), PATH_ARGS (&action_for->file));
     
     /* does the action want the current name of action_pending? */
-    if (g_strcmp0 (action->new_name, action_pending->file) == 0)
+    if (path_equal (&action->new_file, &action_pending->file))
     {
         /* yes! cool, since action_pending wants to free it, conflict resolved! */
         debug (LEVEL_DEBUG, "match! conflict-FS resolved, marking to-rename\n");
         action->state &= ~ST_CONFLICT_FS;
         --nb_conflicts;
         set_to_rename (action, action_for);
-        debug (LEVEL_VERBOSE, "<- resolve_conflict_FS (%s, pending: %s, for: %s)\n",
-               action->file, action_pending->file, action_for->file);
+        debug (LEVEL_VERBOSE, "<- resolve_conflict_FS (%s/%s, pending: %s/%s, for: %s/%s)\n",
+               PATH_ARGS (&action->file), PATH_ARGS (&action_pending->file), PATH_ARGS (&action_for->file));
         return TRUE;
     }
     
     /* check if the new name is already taken by a file we'll process */
-    a = g_hash_table_lookup (actions, (gpointer) action->new_name);
+    a = g_hash_table_lookup (actions, (gpointer) &action->new_file);
     if (a)
     {
         debug (LEVEL_VERBOSE, "an action owns the action's new name!\n");
@@ -187,8 +202,8 @@ resolve_conflict_FS (action_t *action, action_t *action_pending, action_t *actio
             debug (LEVEL_VERBOSE, "said action will free the name, ");
             debug (LEVEL_DEBUG, "conflict-FS resolved, marking to-rename\n");
             set_to_rename (action, action_for);
-            debug (LEVEL_VERBOSE, "<- resolve_conflict_FS (%s, pending: %s, for: %s)\n",
-                   action->file, action_pending->file, action_for->file);
+            debug (LEVEL_VERBOSE, "<- resolve_conflict_FS (%s/%s, pending: %s/%s, for: %s/%s)\n",
+                   PATH_ARGS (&action->file), PATH_ARGS (&action_pending->file), PATH_ARGS (&action_for->file));
             return TRUE;
         }
         else if (a->state & ST_CONFLICT_FS)
@@ -204,8 +219,8 @@ resolve_conflict_FS (action_t *action, action_t *action_pending, action_t *actio
                     debug (LEVEL_DEBUG, "conflict-FS resolved, marking to-rename\n");
                     set_to_rename (action, action_for);
                 }
-                debug (LEVEL_VERBOSE, "<- resolve_conflict_FS (%s, pending: %s, for: %s)\n",
-                       action->file, action_pending->file, action_for->file);
+                debug (LEVEL_VERBOSE, "<- resolve_conflict_FS (%s/%s, pending: %s/%s, for: %s/%s)\n",
+                       PATH_ARGS (&action->file), PATH_ARGS (&action_pending->file), PATH_ARGS (&action_for->file));
                 return TRUE;
             }
         }
@@ -216,8 +231,8 @@ resolve_conflict_FS (action_t *action, action_t *action_pending, action_t *actio
     }
     
     debug (LEVEL_DEBUG, "could not resolve conflict-FS\n");
-    debug (LEVEL_VERBOSE, "<- resolve_conflict_FS (%s, pending: %s, for: %s)\n",
-           action->file, action_pending->file, action_for->file);
+    debug (LEVEL_VERBOSE, "<- resolve_conflict_FS (%s/%s, pending: %s/%s, for: %s/%s)\n",
+           PATH_ARGS (&action->file), PATH_ARGS (&action_pending->file), PATH_ARGS (&action_for->file));
     return FALSE;
 }
 
@@ -226,9 +241,9 @@ set_to_rename (action_t *action, action_t *action_for)
 {
     action_t *a;
     
-    debug (LEVEL_DEBUG, "-> set_to_rename (%s, for: %s)\n",
-           action->file,
-           action_for->file);
+    debug (LEVEL_DEBUG, "-> set_to_rename (%s/%s, for: %s/%s)\n",
+           PATH_ARGS (&action->file),
+           PATH_ARGS (&action_for->file));
     
     /* make sure the new name is not already taken (i.e. that another action
      * isn't already trying to get it -- this does NOT check if an action
@@ -236,23 +251,23 @@ set_to_rename (action_t *action, action_t *action_for)
     if (!ensure_new_name_free (action))
     {
         /* action was marked conflict, we're done here */
-        debug (LEVEL_VERBOSE, "<- set_to_rename (%s, for: %s)\n",
-               action->file,
-               action_for->file);
+        debug (LEVEL_VERBOSE, "<- set_to_rename (%s/%s, for: %s/%s)\n",
+               PATH_ARGS (&action->file),
+               PATH_ARGS (&action_for->file));
         return;
     }
     
     /* if we're doing this fo ran action owning our new name, it'll be free */
-    if (g_strcmp0 (action->new_name, action_for->file) == 0)
+    if (path_equal (&action->new_file, &action_for->file))
     {
         debug (LEVEL_VERBOSE, "action will take name of action_for\n");
     }
     else
     {
-        debug (LEVEL_VERBOSE, "check if an action owns the new name (%s)\n",
-               action->new_name);
+        debug (LEVEL_VERBOSE, "check if an action owns the new name (%s/%s)\n",
+               PATH_ARGS (&action->new_file));
         /* is there already an action that owns the new name? */
-        a = g_hash_table_lookup (actions, (gpointer) action->new_name);
+        a = g_hash_table_lookup (actions, (gpointer) &action->new_file);
         if (a)
         {
             debug (LEVEL_VERBOSE, "an action owns our new name!\n");
@@ -292,9 +307,9 @@ set_to_rename (action_t *action, action_t *action_for)
                         * same situation with it ourself */
                         debug (LEVEL_VERBOSE, "...failed; marking conflict-FS\n");
                         set_conflict_FS (action);
-                        debug (LEVEL_VERBOSE, "<- set_to_rename (%s, for: %s)\n",
-                               action->file,
-                               action_for->file);
+                        debug (LEVEL_VERBOSE, "<- set_to_rename (%s/%s, for: %s/%s)\n",
+                               PATH_ARGS (&action->file),
+                               PATH_ARGS (&action_for->file));
                         return;
                     }
                 }
@@ -304,9 +319,9 @@ set_to_rename (action_t *action, action_t *action_for)
                     debug (LEVEL_VERBOSE, "said action can't/won't be renamed; "
                         "marking conflict-FS\n");
                     set_conflict_FS (action);
-                    debug (LEVEL_VERBOSE, "<- set_to_rename (%s, for: %s)\n",
-                           action->file,
-                           action_for->file);
+                    debug (LEVEL_VERBOSE, "<- set_to_rename (%s/%s, for: %s/%s)\n",
+                           PATH_ARGS (&action->file),
+                           PATH_ARGS (&action_for->file));
                     return;
                 }
             }
@@ -320,7 +335,7 @@ set_to_rename (action_t *action, action_t *action_for)
             /* if not, check the file system (if so, we assume things have
             * been dealt with before calling set_to_rename) */
             debug (LEVEL_VERBOSE, "no action owns the new name, checking FS\n");
-            if (g_file_test (action->new_name, G_FILE_TEST_EXISTS))
+            if (file_exists (&action->new_file))
             {
                 debug (LEVEL_DEBUG, "file exists already, marking conflict-FS\n");
                 action->state |= ST_CONFLICT_FS;
@@ -333,7 +348,7 @@ set_to_rename (action_t *action, action_t *action_for)
      * failed) we need to take it - that way we'll get updated if to conflict
      * if another action also wants that name */
     debug (LEVEL_VERBOSE, "adding action to list of new names\n");
-    g_hash_table_insert (new_names, (gpointer) action->new_name,
+    g_hash_table_insert (new_names, (gpointer) &action->new_file,
                          (gpointer) action);
     
     /* unless we marked conflict-FS, we mark to-rename */
@@ -353,18 +368,18 @@ set_to_rename (action_t *action, action_t *action_for)
         action->state |= ST_TO_RENAME;
         
         /* is there an action that wants our old name? */
-        a = g_hash_table_lookup (new_names, (gpointer) action->file);
+        a = g_hash_table_lookup (new_names, (gpointer) &action->file);
         if (a && a->state & ST_CONFLICT_FS)
         {
-            debug (LEVEL_DEBUG, "unmarking conflict-FS for action for %s\n",
-                a->file);
+            debug (LEVEL_DEBUG, "unmarking conflict-FS for action for %s/%s\n",
+                PATH_ARGS (&a->file));
             a->state &= ~ST_CONFLICT_FS;
             --nb_conflicts;
             set_to_rename (a, a);
         }
     }
     
-    debug (LEVEL_VERBOSE, "<- set_to_rename (%s, for: %s)\n",
-           action->file,
-           action_for->file);
+    debug (LEVEL_VERBOSE, "<- set_to_rename (%s/%s, for: %s/%s)\n",
+           PATH_ARGS (&action->file),
+           PATH_ARGS (&action_for->file));
 }
@@ -0,0 +1,105 @@
+/**
+ * molt - Copyright (C) 2012 Olivier Brunel
+ *
+ * buffer.c
+ * Copyright (C) 2012 Olivier Brunel <i.am.jack.mail@gmail.com>
+ *
+ * This file is part of molt.
+ *
+ * molt is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * molt is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * molt. If not, see http://www.gnu.org/licenses/
+ */
+
+/* C */
+#include <string.h>
+
+/* molt */
+#include "buffer.h"
+
+/* minimum size allocated */
+#define MIN_ALLOC           256
+
+static void buffers_free (molt_buf_t *bufs);
+
+/* each thread has its own pair, so there's no locking */
+static GPrivate buffers_key = G_PRIVATE_INIT ((GDestroyNotify) buffers_free);
+
+/* makes sure there's room for len more bytes (and the NUL), and returns where
+ * they go. Up to the caller to then update buf->len */
+gchar *
+buffer_reserve (molt_buf_t *buf, gsize len)
+{
+    gsize alloc;
+    
+    if (G_UNLIKELY (buf->len + len >= buf->alloc))
+    {
+        alloc = MAX ((buf->len + len + 1) * 2, MIN_ALLOC);
+        buf->str = g_realloc (buf->str, alloc);
+        buf->alloc = alloc;
+    }
+    return buf->str + buf->len;
+}
+
+void
+buffer_append (molt_buf_t *buf, const gchar *str, gsize len)
+{
+    memcpy (buffer_reserve (buf, len), str, len);
+    buf->len += len;
+    buf->str[buf->len] = '\0';
+}
+
+void
+buffer_free (molt_buf_t *buf)
+{
+    g_free (buf->str);
+    buf->str = NULL;
+    buf->len = buf->alloc = 0;
+}
+
+static void
+buffers_free (molt_buf_t *bufs)
+{
+    buffer_free (&bufs[0]);
+    buffer_free (&bufs[1]);
+    g_free (bufs);
+}
+
+/* returns the two buffers of the calling thread, which new names from rules go
+ * into in turns: one holds the current name, while the other gets the next */
+molt_buf_t *
+buffer_get_pair (void)
+{
+    molt_buf_t *bufs;
+    
+    bufs = g_private_get (&buffers_key);
+    if (G_UNLIKELY (!bufs))
+    {
+        bufs = g_new0 (molt_buf_t, 2);
+        g_private_set (&buffers_key, bufs);
+    }
+    return bufs;
+}
+
+/* frees the buffers of the calling thread (others are when threads exit) */
+void
+buffer_clear (void)
+{
+    molt_buf_t *bufs;
+    
+    bufs = g_private_get (&buffers_key);
+    if (bufs)
+    {
+        buffers_free (bufs);
+        g_private_set (&buffers_key, NULL);
+    }
+}
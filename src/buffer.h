@@ -0,0 +1,59 @@
+/**
+ * molt - Copyright (C) 2012 Olivier Brunel
+ *
+ * buffer.h
+ * Copyright (C) 2012 Olivier Brunel <i.am.jack.mail@gmail.com>
+ *
+ * This file is part of molt.
+ *
+ * molt is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * molt is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * molt. If not, see http://www.gnu.org/licenses/
+ */
+
+
+#ifndef BUFFER_H
+#define	BUFFER_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/* glib */
+#include <glib-2.0/glib.h>
+
+/* molt */
+#include "molt.h"
+
+/* growable buffers (molt_buf_t) rules write new names into. Memory is only
+ * released when the buffers are freed, so once grown they're just reused */
+
+gchar *
+buffer_reserve (molt_buf_t *buf, gsize len);
+
+void
+buffer_append (molt_buf_t *buf, const gchar *str, gsize len);
+
+void
+buffer_free (molt_buf_t *buf);
+
+molt_buf_t *
+buffer_get_pair (void);
+
+void
+buffer_clear (void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* BUFFER_H */
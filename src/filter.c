@@ -0,0 +1,135 @@
+/**
+ * molt - Copyright (C) 2012 Olivier Brunel
+ *
+ * filter.c
+ * Copyright (C) 2012 Olivier Brunel <i.am.jack.mail@gmail.com>
+ *
+ * This file is part of molt.
+ *
+ * molt is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * molt is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * molt. If not, see http://www.gnu.org/licenses/
+ */
+
+
+/* C */
+#include <fnmatch.h>
+
+/* molt */
+#include "filter.h"
+
+typedef struct {
+    gchar  *glob;
+    GRegex *regex;
+} pattern_t;
+
+struct _filter_t {
+    GSList *includes;
+    GSList *excludes;
+};
+
+filter_t *
+filter_new (void)
+{
+    return g_new0 (filter_t, 1);
+}
+
+static void
+add_pattern (filter_t *filter, filter_mode_t mode, pattern_t *pattern)
+{
+    if (mode == FILTER_INCLUDE)
+    {
+        filter->includes = g_slist_append (filter->includes, pattern);
+    }
+    else
+    {
+        filter->excludes = g_slist_append (filter->excludes, pattern);
+    }
+}
+
+void
+filter_add_glob (filter_t *filter, filter_mode_t mode, const gchar *pattern)
+{
+    pattern_t *p;
+    
+    p = g_new0 (pattern_t, 1);
+    p->glob = g_strdup (pattern);
+    add_pattern (filter, mode, p);
+}
+
+gboolean
+filter_add_regex (filter_t *filter, filter_mode_t mode, const gchar *pattern,
+                  GError **error)
+{
+    GRegex    *regex;
+    pattern_t *p;
+    
+    regex = g_regex_new (pattern, G_REGEX_OPTIMIZE, 0, error);
+    if (!regex)
+    {
+        return FALSE;
+    }
+    p = g_new0 (pattern_t, 1);
+    p->regex = regex;
+    add_pattern (filter, mode, p);
+    return TRUE;
+}
+
+static gboolean
+match_any (GSList *patterns, const gchar *name)
+{
+    pattern_t *p;
+    GSList    *l;
+    
+    for (l = patterns; l; l = l->next)
+    {
+        p = l->data;
+        if ((p->glob) ? fnmatch (p->glob, name, 0) == 0
+                : g_regex_match (p->regex, name, 0, NULL))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* returns whether name should be processed, i.e. it matches one of the
+ * include patterns (if any), and none of the exclude ones. Does not modify
+ * anything, so it can be used from multiple threads */
+gboolean
+filter_match (filter_t *filter, const gchar *name)
+{
+    if (filter->includes && !match_any (filter->includes, name))
+    {
+        return FALSE;
+    }
+    return !match_any (filter->excludes, name);
+}
+
+static void
+free_pattern (pattern_t *pattern)
+{
+    if (pattern->regex)
+    {
+        g_regex_unref (pattern->regex);
+    }
+    g_free (pattern->glob);
+    g_free (pattern);
+}
+
+void
+filter_free (filter_t *filter)
+{
+    g_slist_free_full (filter->includes, (GDestroyNotify) free_pattern);
+    g_slist_free_full (filter->excludes, (GDestroyNotify) free_pattern);
+    g_free (filter);
+}
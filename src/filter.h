@@ -0,0 +1,61 @@
+/**
+ * molt - Copyright (C) 2012 Olivier Brunel
+ *
+ * filter.h
+ * Copyright (C) 2012 Olivier Brunel <i.am.jack.mail@gmail.com>
+ *
+ * This file is part of molt.
+ *
+ * molt is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * molt is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * molt. If not, see http://www.gnu.org/licenses/
+ */
+
+
+#ifndef FILTER_H
+#define	FILTER_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+    
+/* glib */
+#include <glib-2.0/glib.h>
+    
+typedef enum {
+    FILTER_INCLUDE = 0,
+    FILTER_EXCLUDE,
+} filter_mode_t;
+    
+typedef struct _filter_t filter_t;
+    
+filter_t *
+filter_new (void);
+    
+void
+filter_add_glob (filter_t *filter, filter_mode_t mode, const gchar *pattern);
+    
+gboolean
+filter_add_regex (filter_t *filter, filter_mode_t mode, const gchar *pattern,
+                  GError **error);
+    
+gboolean
+filter_match (filter_t *filter, const gchar *name);
+    
+void
+filter_free (filter_t *filter);
+    
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* FILTER_H */
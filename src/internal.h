@@ -27,6 +27,12 @@
 extern "C" {
 #endif
 
+/* C */
+#include <sys/types.h>
+
+/* molt */
+#include "paths.h"
+
 #define MOLT_ERROR          g_quark_from_static_string ("molt error")
 
 typedef enum {
@@ -52,13 +58,21 @@ typedef enum {
 /* action: original filename, new one, etc */
 typedef struct {
     guint     cur;
-	gchar    *file;
-    gchar    *filename;
-	gchar    *new_name;
-    gchar    *new_filename;
-	gchar    *tmp_name;
+    path_t    file;         /* directory & name of the file */
+	gchar    *new_name;     /* name as given by the rules (only while they run) */
+    path_t    new_file;     /* directory & new name (if any) */
+	gchar    *tmp_name;     /* name (in new_file.dir) for two-steps renaming */
 	state_t   state;
     gchar    *error;
+    /* cached values of per-file variables (only while rules run) */
+    GHashTable *var_per_file;
+    /* info on file, from the (only) stat done on it */
+    mode_t    mode;
+    dev_t     dev;
+    ino_t     ino;
+    nlink_t   nlink;
+    off_t     size;
+    time_t    mtime;
 } action_t;
 
 /* main.c */
@@ -67,6 +81,7 @@ gboolean get_stdin (gpointer *stream, GError **error);
 gboolean add_rule (rule_def_t *rule);
 gboolean add_var (var_def_t *variable);
 gboolean add_var_value (const gchar *name, gchar *params, gchar *value);
+GHashTable *get_var_per_file (void);
 
 /* actions.c */
 void set_to_rename (action_t *action, action_t *action_for);
@@ -22,13 +22,20 @@
 
 #define IS_MOLT
 
+#define _POSIX_C_SOURCE 200809L /* for lstat() & fstatat() */
+
+#define _UNUSED_            __attribute__ ((unused)) 
+
 /* C */
 #include <stdio.h>
+#include <stddef.h> /* offsetof */
 #include <stdlib.h> /* exit */
 #include <string.h>
 #include <time.h> /* for debug() */
 #include <unistd.h> /* getcwd */
 #include <errno.h>
+#include <fcntl.h> /* AT_SYMLINK_NOFOLLOW */
+#include <sys/stat.h>
 
 /* glib */
 #include <gmodule.h>
@@ -36,11 +43,23 @@
 /* molt */
 #include "molt.h"
 #include "internal.h"
+/* walking directories */
+#include "walk.h"
 #include "main.h"
 /* rules */
 #include "rules.h"
 /* variables */
 #include "variables.h"
+/* reading lists from stdin */
+#include "reader.h"
+/* looking up files ahead */
+#include "prefetch.h"
+/* include/exclude patterns */
+#include "filter.h"
+/* templates of new names */
+#include "template.h"
+/* buffers new names are written into */
+#include "buffer.h"
 
 /* verbose/debug level */
 static level_t     level            = 0;
@@ -62,10 +81,15 @@ GHashTable        *actions          = NULL;
  * whether or not there's (already) one, to detect conflicts. 
  * (not static for use in actions.c ) */
 GHashTable        *new_names        = NULL;
+/* actions by inode (st_dev & st_ino), to find the same file given through
+ * different paths (e.g. a symlinked parent, or a bind mount) */
+static GHashTable *inodes           = NULL;
 /* number of conflicts (standard & FS) (not static for use in actions.c ) */
 gint               nb_conflicts     = 0;
 /* number of actions requiring two-steps renaming jobs (not static for use in actions.c ) */
 gint               nb_two_steps     = 0;
+/* separator of names read from stdin (not static for use in rules.c) */
+gchar              stdin_delim      = '\n';
 /* current pathname */
 static gchar      *curdir           = NULL;
 /* whether rules are given the full path/filename (or just filename) */
@@ -75,19 +99,33 @@ static gboolean    output_fullname  = FALSE;
 /* whether rules can give a new name with slashes or not */
 /* Note: only if process_fullname == FALSE obviously */
 static gboolean    allow_path       = FALSE;
+/* in streaming mode (else NULL), how to process actions as we go */
+static process_t  *streaming        = NULL;
+/* in streaming mode, path of the directory the current actions are in */
+static dir_t      *stream_dir       = NULL;
+/* API version of the plugin being initialized (0 for molt itself) */
+static gint        plugin_api       = 0;
+/* with --jobs, pool of threads applying rules (NULL if none) */
+static rules_pool_t *rules_pool      = NULL;
+/* with rules running on batches, actions waiting for theirs (NULL if none) */
+static rules_batch_t *rules_batch    = NULL;
+/* when all rules are pure, cache of new names (NULL if none) */
+static rules_cache_t *rules_cache    = NULL;
+/* include/exclude patterns names are checked against (NULL if none) */
+static filter_t   *filter           = NULL;
 /* list of supported variables */
 static GHashTable *variables        = NULL;
-/* cached values for per-file variables */
-static GHashTable *var_per_file     = NULL;
-/* cached values for global variables */
+/* cached values for global variables (per-file ones are in the action) */
 static GHashTable *var_global       = NULL;
+/* action rules are applied to on the current thread, if a single one */
+static GPrivate    cur_action       = G_PRIVATE_INIT (NULL);
 
 void
 debug (level_t lvl, const gchar *fmt, ...)
 {
     va_list    args;
     time_t     now;
-    struct tm *ptr;
+    struct tm  tm;
     gchar      buf[10];
     
     if (lvl > level)
@@ -96,13 +134,16 @@ debug (level_t lvl, const gchar *fmt, ...)
     }
     
     now = time (NULL);
-    ptr = localtime (&now);
-    strftime (buf, 10, "%H:%M:%S", ptr);
+    /* we might be called from different threads (walking, rules) */
+    localtime_r (&now, &tm);
+    strftime (buf, 10, "%H:%M:%S", &tm);
+    flockfile (stdout);
     fprintf (stdout, "[%s] ", buf);
     
     va_start (args, fmt);
     vfprintf (stdout, fmt, args);
     va_end (args);
+    funlockfile (stdout);
 }
 
 static void
@@ -177,9 +218,14 @@ add_rule (rule_def_t *rule)
         return FALSE;
     }
     
-    /* create our own copy of the rule_def_t */
-    new_rule = g_slice_new (rule_def_t);
-    memcpy (new_rule, rule, sizeof (rule_def_t));
+    /* create our own copy of the rule_def_t. A plugin using an older API
+     * gave us a smaller struct, without the fields added since */
+    new_rule = g_slice_new0 (rule_def_t);
+    memcpy (new_rule, rule,
+            (plugin_api == 1) ? offsetof (rule_def_t, flags)
+            : (plugin_api == 2) ? offsetof (rule_def_t, run_buf)
+            : (plugin_api == 3) ? offsetof (rule_def_t, run_batch)
+            : sizeof (rule_def_t));
     /* and store it in our hashmap of rules */
     g_hash_table_insert (rules, (gpointer) new_rule->name, (gpointer) new_rule);
     
@@ -225,11 +271,30 @@ free_variable (var_def_t *variable)
     g_slice_free (var_def_t, variable);
 }
 
+static guint
+inode_hash (gconstpointer key)
+{
+    const action_t *action = key;
+    
+    return (guint) (action->ino ^ ((guint64) action->ino >> 32) ^ action->dev);
+}
+
+static gboolean
+inode_equal (gconstpointer a, gconstpointer b)
+{
+    const action_t *a1 = a;
+    const action_t *a2 = b;
+    
+    return a1->ino == a2->ino && a1->dev == a2->dev;
+}
+
 static void
 free_action (action_t *action)
 {
-    debug (LEVEL_VERBOSE, "free-ing action for %s\n", action->file);
-    g_free (action->file);
+    debug (LEVEL_VERBOSE, "free-ing action for %s/%s\n",
+           PATH_ARGS (&action->file));
+    g_free (action->file.name);
+    g_free (action->new_file.name);
     if (action->tmp_name)
     {
         g_free (action->tmp_name);
@@ -242,6 +307,10 @@ free_action (action_t *action)
     {
         g_free (action->error);
     }
+    if (action->var_per_file)
+    {
+        g_hash_table_destroy (action->var_per_file);
+    }
     g_slice_free (action_t, action);
 }
 
@@ -253,57 +322,65 @@ strpchr (gchar *string, gchar *start, gchar c)
     return (*start == c) ? start : NULL;
 }
 
-static void
-set_full_file_name (gchar *file, gchar **fullname, gchar **filename)
+/* sets path for file, which is relative to directory dir (unless it's an
+ * absolute path). Returns FALSE if there's no filename (i.e. it ends with a
+ * slash) */
+static gboolean
+set_path (const gchar *file, const gchar *dir, path_t *path)
 {
-    gchar *path;
-    gchar *s, *p;
+    gchar   *fullname;
+    gchar   *path_s;
+    gchar   *s, *p;
+    gboolean has_name;
     
-    debug (LEVEL_VERBOSE, "setting {full,file}name for %s\n", file);
+    debug (LEVEL_VERBOSE, "setting path for %s\n", file);
     
     if (file[0] == '/')
     {
-        *fullname = g_malloc (strlen (file) + 1);
-        sprintf (*fullname, "%s", file);
-        
+        fullname = g_strdup (file);
     }
     else
     {
-        *fullname = g_malloc (strlen (curdir) + strlen (file) + 2);
-        sprintf (*fullname, "%s/%s", curdir, file);
+        fullname = g_strconcat (dir, "/", file, NULL);
     }
     
-    path = *fullname + 1;
-    while ((s = strchr (path, '/')))
+    path_s = fullname + 1;
+    while ((s = strchr (path_s, '/')))
     {
-        if (s == path + 1 && *path == '.')
+        if (s == path_s)
+        {
+            /* double slash, remove one */
+            memmove (path_s, s + 1, strlen (s + 1) + 1);
+        }
+        else if (s == path_s + 1 && *path_s == '.')
         {
             /* simply move the part after "./" to remove it */
-            memmove (path, s + 1, strlen (s + 1) + 1);
-            /* no need to move path, since we move the string within */
+            memmove (path_s, s + 1, strlen (s + 1) + 1);
+            /* no need to move path_s, since we move the string within */
         }
-        else if (s == path + 2 && *path == '.' && *(path + 1) == '.')
+        else if (s == path_s + 2 && *path_s == '.' && *(path_s + 1) == '.')
         {
             /* find the "/" before the current one */
-            p = strpchr (*fullname, path - 2, '/');
+            p = strpchr (fullname, path_s - 2, '/');
             if (!p)
             {
                 break;
             }
-            /* and move the part after "../" back before */            
+            /* and move the part after "../" back before */
             memmove (p + 1, s + 1, strlen (s + 1) + 1);
-            /* now update path to point to the newly copied path */
-            path = p + 1;
+            /* now update path_s to point to the newly copied path */
+            path_s = p + 1;
         }
         else
         {
-            path = s + 1;
+            path_s = s + 1;
         }
     }
     
-    s = strrchr (*fullname, '/');
-    *filename = s + 1;
-    debug (LEVEL_DEBUG, "fullname=%s -- filename=%s\n", *fullname, *filename);
+    has_name = path_set (path, fullname);
+    g_free (fullname);
+    debug (LEVEL_DEBUG, "dir=%s -- filename=%s\n", path->dir->path, path->name);
+    return has_name;
 }
 
 static void
@@ -414,11 +491,21 @@ free_memory (void)
         g_hash_table_destroy (actions);
     }
     
+    if (inodes)
+    {
+        debug (LEVEL_DEBUG, "free-ing list of inodes\n");
+        g_hash_table_destroy (inodes);
+    }
+    
     if (new_names)
     {
         debug (LEVEL_DEBUG, "free-ing list of new names\n");
         g_hash_table_destroy (new_names);
     }
+    
+    /* after actions, since they point to directories */
+    debug (LEVEL_DEBUG, "free-ing directories\n");
+    dirs_free ();
 
     if (rules)
     {
@@ -430,7 +517,6 @@ free_memory (void)
     {
         debug (LEVEL_DEBUG, "free-ing variables\n");
         g_hash_table_destroy (variables);
-        g_hash_table_destroy (var_per_file);
         g_hash_table_destroy (var_global);
     }
     
@@ -443,41 +529,68 @@ free_memory (void)
     {
         free (curdir);
     }
+    
+    if (filter)
+    {
+        filter_free (filter);
+    }
+    
+    buffer_clear ();
 }
 
-gboolean
-add_var_value (const gchar *name, gchar *params, gchar *value)
+/* returns the cache of values of per-file variables of the action rules are
+ * applied to on the current thread, or NULL if variables aren't used or rules
+ * aren't applied to a single action (i.e. run on a batch) */
+GHashTable *
+get_var_per_file (void)
 {
-    var_def_t *variable;
-    gchar *s, *ss;
-    size_t l1, l2;
+    action_t *action;
     
-    variable = g_hash_table_lookup (variables, (gpointer) name);
-    if (!variable)
+    if (!variables || !(action = g_private_get (&cur_action)))
     {
-        return FALSE;
+        return NULL;
     }
+    if (!action->var_per_file)
+    {
+        action->var_per_file = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                      (GDestroyNotify) g_free,
+                                                      (GDestroyNotify) g_free);
+    }
+    return action->var_per_file;
+}
+
+/* caches value (taking ownership) of variable under key (name:params) */
+static gboolean
+set_var_value (var_def_t *variable, gchar *key, gchar *value)
+{
+    GHashTable *cache;
     
-    l1 = strlen (name);
-    l2 = strlen (params);
-    ss = s = g_malloc ((l1 + l2 + 2) * sizeof (*s));
-    memcpy (ss, name, l1);
-    ss += l1;
-    *ss++ = '/';
-    memcpy (ss, params, l2);
-    ss += l2;
-    *ss = '\0';
-    
-    if (variable->type == VAR_TYPE_PER_FILE)
+    cache = (variable->type == VAR_TYPE_PER_FILE) ? get_var_per_file ()
+                                                  : var_global;
+    if (G_UNLIKELY (!cache))
     {
-        g_hash_table_insert (var_per_file, (gpointer) s, (gpointer) g_strdup (value));
+        g_free (key);
+        g_free (value);
+        return FALSE;
     }
-    else
+    g_hash_table_replace (cache, (gpointer) key, (gpointer) value);
+    return TRUE;
+}
+
+gboolean
+add_var_value (const gchar *name, gchar *params, gchar *value)
+{
+    var_def_t *variable;
+    
+    if (!variables
+            || !(variable = g_hash_table_lookup (variables, (gpointer) name)))
     {
-        g_hash_table_insert (var_global, (gpointer) s, (gpointer) g_strdup (value));
+        return FALSE;
     }
     
-    return TRUE;
+    /* same key as looked up in get_var_value() */
+    return set_var_value (variable, g_strconcat (name, ":", params, NULL),
+                          g_strdup (value));
 }
 
 static inline void
@@ -491,11 +604,6 @@ init_variables (void)
     variables = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
                                         (GDestroyNotify) free_variable);
 
-    /* create hashmap of cached values for per-file variables */
-    var_per_file = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                            (GDestroyNotify) g_free,
-                                            (GDestroyNotify) g_free);
-
     /* create hashmap of cached values for global variables */
     var_global = g_hash_table_new_full (g_str_hash, g_str_equal,
                                         (GDestroyNotify) g_free,
@@ -516,6 +624,17 @@ init_variables (void)
     variable->get_value = var_get_value_nb;
     add_var (variable);
 
+    variable->name = "RE";
+    variable->description = "Capture group of the last rule regex to match";
+    variable->help = "Parameter: the number or name of the group, 0 being the\n"
+        "whole match. Values are from the first match, and are empty for\n"
+        "groups not set.\n"
+        "E.g: $RE:year$ after --regex '(?<year>[0-9]{4})'";
+    variable->type = VAR_TYPE_PER_FILE;
+    variable->param = PARAM_NO_SPLIT;
+    variable->get_value = var_get_value_re;
+    add_var (variable);
+
     g_free (variable);
 
     debug (LEVEL_DEBUG, "loading variables from plugins\n");
@@ -542,231 +661,132 @@ init_variables (void)
         init_vars ();
     }
 }
-static gchar *
-get_var_value (action_t *action, gchar var[255], guint len, GError **_error)
+/* returns the value of var for action (data), from the caches if possible */
+static const gchar *
+get_var_value (template_var_t *var, gpointer data, GError **_error)
 {
+    action_t   *action = data;
     GError     *local_err = NULL;
-    gchar      *params;
     gchar      *value;
+    gchar      *file;
     var_def_t  *variable;
-    GPtrArray  *arr = NULL;
     
-    /* any params? */
-    params = strchr (var, ':');
-    if (!params)
-    {
-        params = &(var[len]);
-        /* no params, we add a : for the key of cached values */
-        var[len++] = ':';
-        var[len] = '\0';
-    }
+    debug (LEVEL_VERBOSE, "looking up caches for: %s\n", var->key);
     
-    debug (LEVEL_VERBOSE, "looking up caches for: %s\n", var);
-
     /* do we have the value cached? */
-    value = g_hash_table_lookup (var_per_file, (gpointer) var);
+    value = g_hash_table_lookup (get_var_per_file (), (gpointer) var->key);
     if (value)
     {
         debug (LEVEL_VERBOSE, "found: %s\n", value);
         return value;
     }
-    value = g_hash_table_lookup (var_global, (gpointer) var);
+    value = g_hash_table_lookup (var_global, (gpointer) var->key);
     if (value)
     {
         debug (LEVEL_VERBOSE, "found: %s\n", value);
         return value;
     }
     
-    /* we only need the variable's name */
-    *params = '\0';
-    ++params;
     /* make sure such a variable exists then */
-    debug (LEVEL_VERBOSE, "nothing cached, need definition for: %s\n", var);
-    variable = g_hash_table_lookup (variables, (gpointer) var);
+    debug (LEVEL_VERBOSE, "nothing cached, need definition for: %s\n",
+           var->name);
+    variable = g_hash_table_lookup (variables, (gpointer) var->name);
     if (!variable)
     {
-        g_set_error (_error, MOLT_ERROR, 1, "unknown variable %s", var);
+        g_set_error (_error, MOLT_ERROR, 1, "unknown variable %s", var->name);
         return NULL;
     }
-    /* params? */
-    if (*params)
-    {
-        if (variable->param == PARAM_SPLIT)
-        {
-            split_params (':', params, &arr);
-        }
-        else
-        {
-            arr = g_ptr_array_new ();
-            g_ptr_array_add (arr, (gpointer) params);
-        }
-    }
-    /* ask for the value */
-    debug (LEVEL_VERBOSE, "getting value for variable: %s -- params: %s\n",
-           var, params);
-    value = variable->get_value (action->file, arr, &local_err);
-    if (arr)
-    {
-        g_ptr_array_free (arr, TRUE);
-    }
+    /* ask for the value; params were split when the template was parsed */
+    debug (LEVEL_VERBOSE, "getting value for variable: %s\n", var->key);
+    file = path_get_full (&action->file);
+    value = variable->get_value (file,
+            (variable->param == PARAM_SPLIT) ? var->split : var->whole,
+            &local_err);
+    g_free (file);
     if (G_UNLIKELY (local_err))
     {
         g_set_error (_error, MOLT_ERROR, 1,
                      "unable to get value for variable %s: %s",
-                     var, local_err->message);
+                     var->name, local_err->message);
         g_clear_error (&local_err);
         return NULL;
     }
     /* store it in the cache */
-    add_var_value (var, params, value);
     debug (LEVEL_VERBOSE, "got: %s\n", value);
+    set_var_value (variable, g_strdup (var->key), value);
     return value;
 }
 
+/* resolves variables of tpl for action, into out */
 static gboolean
-resolve_variables (action_t *action, gchar **new_name, GError **_error)
+resolve_variables (action_t    *action,
+                   template_t  *tpl,
+                   molt_buf_t  *out,
+                   GError     **_error)
 {
-    GError      *local_err  = NULL;
-    gchar       *s, *ss;
-    gchar       *old;
-    gchar       *name;
-    size_t       l;
-    size_t       len;
-    size_t       alloc;
-    gchar       *start      = NULL;
-    gchar       *last;
-    guint        i;
-    gchar        buf[255];
-    gchar       *value;
-    
-    debug (LEVEL_DEBUG, "parsing variables for: %s\n", action->new_name);
-    
-    /* make a copy of the new name, so we can modify it */
-    old = g_strdup (action->new_name);
-    
-    /* init new name */
-    len = 0;
-    alloc = strlen (old) + 1024;
-    name = g_malloc (alloc * sizeof (*name));
-    
-#define add_str(string) do {                                    \
-        /* length of string to add */                           \
-        l = strlen (string);                                    \
-        /* realloc if needed */                                 \
-        if (len + l >= alloc)                                   \
-        {                                                       \
-            alloc += l + 1024;                                  \
-            name = g_realloc (name, alloc * sizeof (*name));    \
-        }                                                       \
-        /* add it */                                            \
-        memcpy ((void *) &(name[len]), string, l);              \
-        len += l;                                               \
-    } while (0)
-    
-    for (s = last = old; *s; ++s)
-    {
-        /* found a variable marker? (must not be escaped) */
-        if (*s == '$')
-        {
-            /* make sure it's not escaped */
-            for (i = 1, ss = s - 1; ss >= old && *ss == '\\'; --ss, ++i)
-                ;
-            if (!(i % 2))
-            {
-                /* it's escaped, moving on */
-                continue;
-            }
-            
-            /* is it the start? */
-            if (start == NULL)
-            {
-                start = s + 1;
-            }
-            /* ignore case of a %% */
-            else if (s == start)
-            {
-                start = NULL;
-            }
-            /* then it's the end, and we can process it */
-            else
-            {
-                /* we "end" the string here */
-                *s = '\0';
-                /* so start points to the variable name [and params] */
-                i = (guint) snprintf (buf, 255, "%s", start);
-                
-                debug (LEVEL_VERBOSE, "need value for: %s\n", buf);
-                
-                /* get the value (handles params, cache, etc) */
-                value = get_var_value (action, buf, i, &local_err);
-                if (G_UNLIKELY (local_err))
-                {
-                    g_propagate_error (_error, local_err);
-                    g_free (old);
-                    g_free (name);
-                    return FALSE;
-                }
-                
-                /* replace the opening marked with a NULL, so we can add the
-                 * string up to said marker */
-                *(start - 1) = '\0';
-                add_str (last);
-                /* and add the value */
-                add_str (value);
-                
-                /* reset */
-                start = NULL;
-                /* next */
-                last = s + 1;
-            }
-        }
-    }
-    add_str (last);
-    name[len] = '\0';
-    
-#undef add_str
-    
-    *new_name = name;
-    return TRUE;
+    return template_expand (tpl, out, get_var_value, action, _error);
 }
 
 static option_t options[] = {
-    { OPT_EXCLUDE_DIRS,         "exclude-directories",
+    { OPT_EXCLUDE_DIRS,         "exclude-directories", NULL,
       "Ignore directories from specified files" },
-    { OPT_EXCLUDE_FILES,        "exclude-files",
+    { OPT_EXCLUDE_FILES,        "exclude-files", NULL,
       "Ignore files from specified files" },
-    { OPT_EXCLUDE_SYMLINKS,     "exclude-symlinks",
+    { OPT_EXCLUDE_SYMLINKS,     "exclude-symlinks", NULL,
       "Ignore symlinks from specified files" },
-    { OPT_FROM_STDIN,           "from-stdin",
+    { OPT_FROM_STDIN,           "from-stdin", NULL,
       "Get list of files from stdin" },
+    { OPT_INCLUDE,              "include", "GLOB",
+      "Only process files whose name matches GLOB" },
+    { OPT_EXCLUDE,              "exclude", "GLOB",
+      "Ignore files whose name matches GLOB" },
+    { OPT_INCLUDE_REGEX,        "include-regex", "RE",
+      "Only process files whose name matches RE" },
+    { OPT_EXCLUDE_REGEX,        "exclude-regex", "RE",
+      "Ignore files whose name matches RE" },
+    { OPT_RECURSIVE,            "recursive", NULL,
+      "Process the content of directories, recursively" },
+    { OPT_MAX_DEPTH,            "max-depth", "NUM",
+      "Descend at most NUM levels into directories\n(Imply --recursive)" },
+    { OPT_NULL,                 "null", NULL,
+      "Names read from stdin are separated by NULL\ncharacters, not newlines" },
+    { OPT_JOBS,                 "jobs", "NUM",
+      "Use NUM threads to read directories & apply rules" },
+    { OPT_STREAM,               "stream", NULL,
+      "Rename files one directory at a time, as they come\n"
+      "(Conflicts are only checked within a directory)" },
+    { OPT_QUEUE_DEPTH,          "queue-depth", "NUM",
+      "Look up to NUM files ahead, asynchronously\n(Default: 0, disabled)" },
+    { OPT_BATCH_SIZE,           "batch-size", "NUM",
+      "Give rules supporting it up to NUM names at once\n(Default: 1000)" },
 
-    { OPT_PROCESS_FULLNAME,     "process-fullname",
+    { OPT_PROCESS_FULLNAME,     "process-fullname", NULL,
       "Send the full path/name to the rules\n(Imply --output-fullname)" },
-    { OPT_ALLOW_PATH,           "allow-path",
+    { OPT_ALLOW_PATH,           "allow-path", NULL,
       "Allow (relative/absolute) paths in new filenames\n(Imply --output-fullname)" },
-    { OPT_MAKE_PARENTS,         "make-parents",
+    { OPT_MAKE_PARENTS,         "make-parents", NULL,
       "Create parents if needed" },
 
-    { OPT_OUTPUT_FULLNAME,      "output-fullname",
+    { OPT_OUTPUT_FULLNAME,      "output-fullname", NULL,
       "Output full path/names" },
-    { OPT_OUTPUT_BOTH,          "output-both-names",
+    { OPT_OUTPUT_BOTH,          "output-both-names", NULL,
       "Output the old then the new filename for each file" },
-    { OPT_OUTPUT_NEW,           "output-new-names",
+    { OPT_OUTPUT_NEW,           "output-new-names", NULL,
       "Output the new filename for each file" },
-    { OPT_ONLY_RULES,           "only-rules",
+    { OPT_ONLY_RULES,           "only-rules", NULL,
       "Only apply the rules and output results,\nwithout any conflict detection\n"
       "(Imply --dry-run)" },
 
-    { OPT_DRY_RUN,              "dry-run",
+    { OPT_DRY_RUN,              "dry-run", NULL,
       "Do not rename anything" },
-    { OPT_CONTINUE_ON_ERROR,    "continue-on-error",
+    { OPT_CONTINUE_ON_ERROR,    "continue-on-error", NULL,
       "Process as much as possible, even on errors\nor when conflicts are detected" },
 
-    { OPT_DEBUG,                "debug",
+    { OPT_DEBUG,                "debug", NULL,
       "Enable debug mode - Specify twice for verbose\noutput" },
-    { OPT_HELP,                 "help",
+    { OPT_HELP,                 "help", NULL,
       "Show this help screen and exit - Specify twice for\nverbose output" },
-    { OPT_VERSION,              "version",
+    { OPT_VERSION,              "version", NULL,
       "Show version information and exit" },
 };
 static gint nb_options = sizeof (options) / sizeof (options[0]);
@@ -828,7 +848,8 @@ show_help (gboolean verbose)
     for (i = 0; i < nb_options; ++i)
     {
         opt = &options[i];
-        j = fprintf (stdout, " -%c, --%s", opt->opt_short, opt->opt_long);
+        j = fprintf (stdout, " -%c, --%s%s%s", opt->opt_short, opt->opt_long,
+                     (opt->arg) ? " " : "", (opt->arg) ? opt->arg : "");
         put_up_to_spaces (30 - j);
         put_string (opt->help, 31);
     }
@@ -915,10 +936,12 @@ show_version (void)
 #undef put_string
 #undef put_up_to_spaces
 
+/* current short option being processed (within a group, e.g. -nC) */
+static gchar *short_opt = NULL;
+
 static gboolean
 process_arg (int argc, char *argv[], gint *argi, gchar **option)
 {
-    static gchar *c = NULL;
     gint i;
     
     *option = NULL;
@@ -956,39 +979,39 @@ process_arg (int argc, char *argv[], gint *argi, gchar **option)
             /* short option then */
             else
             {
-                if (!c)
+                if (!short_opt)
                 {
-                    c = argv[*argi];
+                    short_opt = argv[*argi];
                     /* if first option is -d|d] it's already been processed */
                     if (*argi == 1)
                     {
-                        if (*(c + 1) == OPT_DEBUG)
+                        if (*(short_opt + 1) == OPT_DEBUG)
                         {
-                            ++c;
-                            if (*(c + 1) == OPT_DEBUG)
+                            ++short_opt;
+                            if (*(short_opt + 1) == OPT_DEBUG)
                             {
-                                ++c;
+                                ++short_opt;
                             }
                         }
                     }
                 }
-                for (++c; *c; ++c)
+                for (++short_opt; *short_opt; ++short_opt)
                 {
                     for (i = 0; i < nb_options; ++i)
                     {
-                        if (*c == options[i].opt_short)
+                        if (*short_opt == options[i].opt_short)
                         {
                             debug (LEVEL_DEBUG, "short option: -%c (--%s)\n",
-                                   *c, options[i].opt_long);
+                                   *short_opt, options[i].opt_long);
                             *option = &options[i].opt_short;
                             return TRUE;
                         }
                     }
-                    *option = c;
-                    debug (LEVEL_VERBOSE, "unknown option -%c\n", *c);
+                    *option = short_opt;
+                    debug (LEVEL_VERBOSE, "unknown option -%c\n", *short_opt);
                     return FALSE;
                 }
-                c = NULL;
+                short_opt = NULL;
                 continue;
             }
         }
@@ -1003,41 +1026,56 @@ process_arg (int argc, char *argv[], gint *argi, gchar **option)
     return FALSE;
 }
 
-static inline void
-show_output (output_t output, gint state, action_t *action, gchar *name)
+static gchar *
+get_option_value (int argc, char *argv[], gint *argi)
 {
-    gchar *file = (output_fullname) ? action->file : action->filename;
-    gchar *new;
-    
-    /* might might be new_name if we renamed */
-    if (name == action->new_name)
-    {
-        new = (output_fullname) ? action->new_name : action->new_filename;
-    }
-    /* or it might be file if there's no rename (whatever the reason) */
-    else if (name == action->file)
-    {
-        new = file;
-    }
-    /* or it could be tmp_name if the 2nd renaming step failed */
-    else /* if (name == action->tmp_name) */
+    gchar *value = NULL;
+
+    /* short option: value is the rest of the group (e.g. -L2) or the next arg */
+    if (short_opt)
     {
-        if (output_fullname)
+        if (*(short_opt + 1) != '\0')
         {
-            new = name;
+            value = short_opt + 1;
+            ++*argi;
+        }
+        else if (*argi + 1 < argc)
+        {
+            value = argv[*argi + 1];
+            *argi += 2;
         }
         else
         {
-            new = strrchr (name, '/');
-            ++new;
+            ++*argi;
         }
+        /* either way, we're done with this group */
+        short_opt = NULL;
+    }
+    /* long option: process_arg already moved to the next arg */
+    else if (*argi < argc)
+    {
+        value = argv[*argi];
+        ++*argi;
     }
+
+    debug (LEVEL_VERBOSE, "option value: %s\n", (value) ? value : "(none)");
+    return value;
+}
+
+static inline void
+show_output (output_t output, gint state, action_t *action, const path_t *name)
+{
+    /* name is either file if there's no rename (whatever the reason), the new
+     * name if we renamed, or the tmp name if the 2nd renaming step failed */
+#define path_args(p)    (output_fullname) ? (p)->dir->path : "", \
+                        (output_fullname) ? "/" : "", (p)->name
     
     /* if there was no success AND there is a tmp_name it can only mean one
      * thing: the second rename (tmp -> new) just failed */
     if (G_UNLIKELY (state != 0 && action->tmp_name))
     {
-        fprintf (stderr, "%s is now %s\n", action->file, action->tmp_name);
+        fprintf (stderr, "%s/%s is now %s/%s\n", PATH_ARGS (&action->file),
+                 action->new_file.dir->path, action->tmp_name);
     }
     
     switch (output)
@@ -1045,22 +1083,24 @@ show_output (output_t output, gint state, action_t *action, gchar *name)
         case OUTPUT_STANDARD:
             if (state == 0)
             {
-                fprintf (stdout, "%s -> %s\n", file, new);
+                fprintf (stdout, "%s%s%s -> %s%s%s\n",
+                         path_args (&action->file), path_args (name));
             }
             break;
         case OUTPUT_BOTH_NAMES:
-            fprintf (stdout, "%s\n", file);
+            fprintf (stdout, "%s%s%s\n", path_args (&action->file));
             /* fall through */
         case OUTPUT_NEW_NAMES:
-            fprintf (stdout, "%s\n", new);
+            fprintf (stdout, "%s%s%s\n", path_args (name));
             break;
     }
+#undef path_args
 }
 
 static gchar *
 get_tmp_name (const gchar *name)
 {
-    gchar buf[15];
+    gchar buf[16];
     FILE *fp;
     int c;
     gint i = 0;
@@ -1090,6 +1130,207 @@ get_tmp_name (const gchar *name)
     return g_strconcat (buf, name, NULL);
 }
 
+/* renames files & shows output for all actions in list */
+static void
+process_actions (GSList *actions_list, process_t *process)
+{
+    action_t *action;
+    GSList   *l;
+    gint      state;
+    path_t    tmp;
+    path_t   *name;
+    
+#define action_error(...)   do {                        \
+    if (nb_two_steps == 0)                              \
+    {                                                   \
+        fprintf (stderr, __VA_ARGS__);                  \
+    }                                                   \
+    else                                                \
+    {                                                   \
+        action->error = g_strdup_printf (__VA_ARGS__);  \
+    }                                                   \
+} while (0)
+
+#define do_rename(old_path, new_path)   do {                        \
+    if (process->make_parents)                                      \
+    {                                                               \
+        debug (LEVEL_DEBUG, "ensuring %s/ exists\n",                \
+               (new_path)->dir->path);                              \
+        dir_make ((new_path)->dir, 0755);                           \
+    }                                                               \
+    debug (LEVEL_DEBUG, "renaming %s/%s to %s/%s\n",                \
+           PATH_ARGS (old_path), PATH_ARGS (new_path));             \
+    if (G_UNLIKELY (0 != (state = path_rename (old_path, new_path)))) \
+    {                                                               \
+        err |= ERROR_RENAME_FAILURE;                                \
+        action_error ("%s/%s: failed to rename to %s/%s: %s\n",     \
+                    PATH_ARGS (&action->file), PATH_ARGS (new_path),\
+                    strerror (errno));                              \
+    }                                                               \
+} while (0)
+    
+    /* process actions: rename files & construct output */
+    for (l = actions_list; l; l = l->next)
+    {
+        action = l->data;
+        name = NULL;
+        state = -1;
+        
+        if (process->only_rules)
+        {
+            name = (action->new_file.name) ? &action->new_file : NULL;
+            nb_two_steps = 0;
+            state = 0;
+        }
+        else if (action->state & ST_TO_RENAME)
+        {
+            /* only rename if we "can" do the rename, i.e. either there was no
+             * conflicts found, or continue-on-error is set */
+            if (nb_conflicts == 0 || process->continue_on_error)
+            {
+                if (!process->dry_run)
+                {
+                    if (action->state & ST_TWO_STEPS)
+                    {
+                        /* tmp file is in the same dir as the new name */
+                        action->tmp_name = get_tmp_name (action->new_file.name);
+                        tmp.dir = action->new_file.dir;
+                        tmp.name = action->tmp_name;
+                        name = &tmp;
+                    }
+                    else
+                    {
+                        name = &action->new_file;
+                    }
+                    
+                    /* tmp_name could be NULL if get_tmp_name() somehow failed */
+                    if (G_LIKELY (name->name))
+                    {
+                        do_rename (&action->file, name);
+                    }
+                    else
+                    {
+                        state = -1;
+                    }
+                    
+                    if (G_UNLIKELY (state != 0))
+                    {
+                        /* do_rename took care of the error message */
+                        if (action->tmp_name)
+                        {
+                            g_free (action->tmp_name);
+                            action->tmp_name = NULL;
+                        }
+                        name = &action->file;
+                        /* remove the to-rename state so that in case of a
+                         * second pass (if nb_two_steps > 0) it isn't seen
+                         * as to-rename and therefore marked as success */
+                        action->state &= ~ST_TO_RENAME;
+                    }
+                }
+                else
+                {
+                    name = &action->new_file;
+                    state = 0;
+                }
+            }
+        }
+        else if (action->state & ST_CONFLICT)
+        {
+            err |= ERROR_CONFLICT_RENAME;
+            action_error ("%s/%s: cannot be renamed, conflict\n", PATH_ARGS (&action->file));
+        }
+        else if (action->state & ST_CONFLICT_FS)
+        {
+            err |= ERROR_CONFLICT_FS;
+            action_error ("%s/%s: cannot be renamed, new name (%s/%s) in use\n",
+                          PATH_ARGS (&action->file), PATH_ARGS (&action->new_file));
+        }
+        if (!name)
+        {
+            name = &action->file;
+        }
+        /* output can be shown if no two-steps renaming are required, else
+         * we prepare it but only show it once everything was processed, in
+         * in order to be accurate and keep the order as expected */
+        if (nb_two_steps == 0)
+        {
+            show_output (process->output, state, action, name);
+        }
+    }
+    
+    /* if there were two-steps renaming, we need to finish them & show output */
+    if (nb_two_steps > 0)
+    {
+        for (l = actions_list; l; l = l->next)
+        {
+            action = l->data;
+            state = -1;
+            /* new name might not be set, e.g. if there was no new name */
+            name = (action->new_file.name) ? &action->new_file : &action->file;
+            
+            if (action->tmp_name)
+            {
+                tmp.dir = action->new_file.dir;
+                tmp.name = action->tmp_name;
+                do_rename (&tmp, name);
+                if (G_UNLIKELY (state != 0))
+                {
+                    /* do_rename took care of the error message */
+                    name = &tmp;
+                }
+            }
+            else if (action->state & ST_TO_RENAME)
+            {
+                state = 0;
+            }
+            
+            if (action->error)
+            {
+                fprintf (stderr, "%s", action->error);
+                g_free (action->error);
+                action->error = NULL;
+            }
+            show_output (process->output, state, action, name);
+            
+            if (action->tmp_name)
+            {
+                g_free (action->tmp_name);
+                action->tmp_name = NULL;
+            }
+        }
+    }
+#undef do_rename
+#undef action_error
+}
+
+/* in streaming mode, processes all actions added so far (i.e. those for files
+ * in stream_dir), then frees them */
+static void
+flush_actions (GSList **actions_list)
+{
+    if (errors)
+    {
+        error_out (!streaming->continue_on_error || err & ERROR_RULE_FAILED);
+    }
+    
+    debug (LEVEL_DEBUG, "processing actions for %s/\n", stream_dir->path);
+    process_actions (*actions_list, streaming);
+    g_slist_free (*actions_list);
+    *actions_list = NULL;
+    g_hash_table_remove_all (new_names);
+    g_hash_table_remove_all (inodes);
+    g_hash_table_remove_all (actions);
+    nb_conflicts = 0;
+    nb_two_steps = 0;
+    
+    /* we can't undo what was done before, but we can stop here */
+    if (err && !streaming->continue_on_error)
+    {
+        error_out (TRUE);
+    }
+}
+
 static void
 free_commands (GSList *commands)
 {
@@ -1109,141 +1350,444 @@ free_commands (GSList *commands)
     g_slist_free (commands);
 }
 
-static void
-add_action_for_file (gchar *file, GFileTest test_types,
-                     GSList *commands, GSList **actions_list)
+/* replaces consecutive built-in rules (case conversions & sr) by a single
+ * command applying them together, e.g. ASCII case conversions in place */
+static GSList *
+fuse_commands (GSList *commands)
 {
-    GError      *local_err = NULL;
-    static guint cur = 0;
-    action_t    *action;
-    command_t   *command;
-    gchar       *new_name;
-    GSList      *l;
-    gboolean     has_resolved_variables = FALSE;
+    static rule_def_t fused_rule = {
+        "fused", "Built-in rules applied together", NULL, PARAM_NONE,
+        NULL, NULL, rule_fused_destroy, FALSE,
+        RULE_FLAG_THREAD_SAFE | RULE_FLAG_PURE, rule_fused, NULL
+    };
+    command_t *command;
+    command_t *fused = NULL;
+    GSList    *l;
+    GSList    *next;
+    
+    for (l = commands; l; l = next)
+    {
+        next = l->next;
+        command = l->data;
+        if (!rule_can_fuse (command->rule, command->data))
+        {
+            fused = NULL;
+            continue;
+        }
+        
+        if (!fused)
+        {
+            /* nothing to fuse a single rule with */
+            if (!next || !rule_can_fuse (((command_t *) next->data)->rule,
+                                         ((command_t *) next->data)->data))
+            {
+                continue;
+            }
+            fused = g_slice_new (command_t);
+            fused->rule = &fused_rule;
+            fused->data = rule_fused_new ();
+            fused->endif = NULL;
+            l->data = fused;
+        }
+        else
+        {
+            commands = g_slist_delete_link (commands, l);
+        }
+        debug (LEVEL_DEBUG, "fusing rule %s\n", command->rule->name);
+        rule_fused_add (fused->data, command->rule, command->data);
+        g_slice_free (command_t, command);
+    }
+    return commands;
+}
+
+/* returns the first of commands that must be applied in order, on the main
+ * thread (i.e. those before can be applied in threads). Rules running on
+ * batches always are. A group of guarded rules isn't split, so when one of
+ * them must be applied there, so is the whole group */
+static GSList *
+get_sequential_commands (GSList *commands)
+{
+    command_t *command;
+    GSList    *guard = NULL;    /* outermost guard whose group isn't over */
     
-    if (!g_file_test (file, G_FILE_TEST_EXISTS))
+    for ( ; commands; commands = commands->next)
     {
-        error (ERROR_FILE, "file does not exist: %s\n", file);
-        return;
+        command = commands->data;
+        if (!(command->rule->flags & RULE_FLAG_THREAD_SAFE)
+                || command->rule->resolve_variables
+                || command->rule->run_batch)
+        {
+            break;
+        }
+        if (!guard && command->endif)
+        {
+            guard = commands;
+        }
+        else if (guard && commands == ((command_t *) guard->data)->endif)
+        {
+            guard = NULL;
+        }
     }
-    if (test_types == (G_FILE_TEST_IS_REGULAR | G_FILE_TEST_IS_DIR
-                        | G_FILE_TEST_IS_SYMLINK))
+    return (guard) ? guard : commands;
+}
+
+/* whether any of commands is from a rule running on batches */
+static gboolean
+has_batch_rule (GSList *commands)
+{
+    command_t *command;
+    
+    for ( ; commands; commands = commands->next)
     {
-        debug (LEVEL_DEBUG, "process: %s\n", file);
+        command = commands->data;
+        if (command->rule->run_batch)
+        {
+            return TRUE;
+        }
     }
-    else if (test_types & G_FILE_TEST_IS_REGULAR
-        && g_file_test (file, G_FILE_TEST_IS_REGULAR))
+    return FALSE;
+}
+
+/* whether all commands are from pure rules, not resolving variables */
+static gboolean
+is_pure (GSList *commands)
+{
+    command_t *command;
+    
+    for ( ; commands; commands = commands->next)
     {
-        debug (LEVEL_DEBUG, "process file: %s\n", file);
+        command = commands->data;
+        if (!(command->rule->flags & RULE_FLAG_PURE)
+                || command->rule->resolve_variables)
+        {
+            return FALSE;
+        }
     }
-    else if (test_types & G_FILE_TEST_IS_DIR
-        && g_file_test (file, G_FILE_TEST_IS_DIR))
+    return TRUE;
+}
+
+/* runs the rule of command on name (of length len), writing into out. Rules
+ * from plugins using an API before 3 allocate their new name, which is then
+ * copied into out */
+static rule_result_t
+run_rule (command_t   *command,
+          const gchar *name,
+          gsize        len,
+          molt_buf_t  *out,
+          GError     **error)
+{
+    gchar *new_name = NULL;
+    
+    if (command->rule->run_buf)
     {
-        debug (LEVEL_DEBUG, "process dir: %s\n", file);
+        return command->rule->run_buf (&(command->data), name, len, out, error);
     }
-    else if (test_types & G_FILE_TEST_IS_SYMLINK
-        && g_file_test (file, G_FILE_TEST_IS_SYMLINK))
+    
+    if (G_UNLIKELY (!command->rule->run (&(command->data), name, &new_name,
+                                         error)))
     {
-        debug (LEVEL_DEBUG, "process symlink: %s\n", file);
+        return RULE_RESULT_ERROR;
     }
-    else
+    else if (!new_name)
     {
-        debug (LEVEL_DEBUG, "ignore: %s\n", file);
-        return;
+        return RULE_RESULT_UNCHANGED;
     }
+    buffer_append (out, new_name, strlen (new_name));
+    g_free (new_name);
+    return RULE_RESULT_CHANGED;
+}
+
+/* clears the cache of per-file values of action, once all rules were applied
+ * to it */
+static void
+clear_var_per_file (action_t *action)
+{
+    if (action->var_per_file)
+    {
+        g_hash_table_destroy (action->var_per_file);
+        action->var_per_file = NULL;
+    }
+}
+
+/* returns the buffer of the pair bufs not holding name, emptied */
+static molt_buf_t *
+get_out_buf (molt_buf_t *bufs, const gchar *name)
+{
+    molt_buf_t *out;
     
-    /* create new action */
-    action = g_slice_new0 (action_t);
-    action->cur = ++cur;
-    set_full_file_name (file, &(action->file), &(action->filename));
-    /* make sure we have a filename */
-    if (*action->filename == '\0')
+    out = (name == bufs[0].str) ? &bufs[1] : &bufs[0];
+    out->len = 0;
+    return out;
+}
+
+/* takes result (and rule_err, if any) of command, run for action on name (of
+ * length len) into the other buffer of bufs: name & len are updated if there's
+ * a new name, and variables then resolved if needed (into the other buffer
+ * again). Returns FALSE on error, put in action->error */
+static gboolean
+take_result (action_t       *action,
+             command_t      *command,
+             rule_result_t   result,
+             GError         *rule_err,
+             molt_buf_t     *bufs,
+             const gchar   **name,
+             gsize          *len)
+{
+    GError      *local_err = NULL;
+    molt_buf_t  *out;
+    template_t  *tpl;
+    gboolean     resolved;
+    
+    switch (result)
+    {
+        case RULE_RESULT_CHANGED:
+            out = (*name == bufs[0].str) ? &bufs[1] : &bufs[0];
+            buffer_reserve (out, 0);
+            out->str[out->len] = '\0';
+            *name = out->str;
+            *len = out->len;
+            debug (LEVEL_VERBOSE, "new name: %s\n", *name);
+            break;
+        case RULE_RESULT_UNCHANGED:
+            break;
+        case RULE_RESULT_ERROR:
+            action->error = g_strdup_printf ("%s/%s: rule %s failed: %s\n",
+                    PATH_ARGS (&action->file), command->rule->name,
+                    rule_err->message);
+            g_error_free (rule_err);
+            return FALSE;
+    }
+    
+    /* should we resolve variables? */
+    if (command->rule->resolve_variables)
     {
-        error (ERROR_SYNTAX, "%s: no filename\n", action->file);
-        free_action (action);
-        --cur;
-        return;
+        /* the template of rule tpl was parsed on init, names are parsed now */
+        if (command->rule->run_buf == rule_tpl)
+        {
+            tpl = command->data;
+        }
+        else
+        {
+            debug (LEVEL_DEBUG, "parsing variables\n");
+            tpl = template_new (*name, &local_err);
+        }
+        out = get_out_buf (bufs, *name);
+        resolved = tpl && resolve_variables (action, tpl, out, &local_err);
+        if (tpl && tpl != command->data)
+        {
+            template_free (tpl);
+        }
+        if (G_LIKELY (resolved))
+        {
+            *name = out->str;
+            *len = out->len;
+            debug (LEVEL_VERBOSE, "new name: %s\n", *name);
+        }
+        else
+        {
+            action->error = g_strdup_printf (
+                    "%s/%s: failed to resolve variables: %s\n",
+                    PATH_ARGS (&action->file), local_err->message);
+            g_clear_error (&local_err);
+            return FALSE;
+        }
     }
-    /* make sure there isn't already an action for this file */
-    if (g_hash_table_lookup (actions, (gpointer) action->file))
+    return TRUE;
+}
+
+/* puts in the new name a copy of the current one, unless already done. This
+ * will be updated once rules were applied, if any did provide a new name */
+static void
+init_new_name (action_t *action)
+{
+    if (!action->new_name)
+    {
+        action->new_name = (process_fullname) ? path_get_full (&action->file)
+                                              : g_strdup (action->file.name);
+    }
+}
+
+/* once rules were applied, sets the new name of action to name (of length
+ * len), or clears it on error */
+static void
+set_new_name (action_t *action, const gchar *name, gsize len)
+{
+    if (action->error)
+    {
+        /* we can't continue processing this action now */
+        g_free (action->new_name);
+        action->new_name = NULL;
+    }
+    else if (name != action->new_name)
+    {
+        g_free (action->new_name);
+        action->new_name = g_strndup (name, len);
+    }
+}
+
+/* applies commands (until end, excluded) to get the new name of action. Since
+ * this might not happen on the main thread, errors are put in action->error.
+ * Rules write their new names in the two buffers of the thread in turns, only
+ * the last one is then copied */
+static void
+apply_rules (action_t *action, GSList *commands, GSList *end)
+{
+    GError        *local_err = NULL;
+    command_t     *command;
+    gchar         *new_name;
+    gchar         *cached = NULL; /* name to cache the new name for */
+    const gchar   *name;
+    gsize          len;
+    molt_buf_t    *bufs;
+    molt_buf_t    *out;
+    GSList        *l;
+    rule_result_t  result;
+    
+    /* a previous rule failed */
+    if (action->error)
     {
-        debug (LEVEL_DEBUG, "already an action for this file, aborting\n");
-        free_action (action);
-        --cur;
         return;
     }
-    /* put in the new name a copy of the current one. this will be free-d
-     * and updated after each rule that does provide a new name */
-    action->new_name = g_strdup ((process_fullname) ? action->file : action->filename);
+    
+    init_new_name (action);
+    
+    if (rules_cache && commands == rules_cache->commands && !end)
+    {
+        g_mutex_lock (&rules_cache->mutex);
+        new_name = g_hash_table_lookup (rules_cache->names, action->new_name);
+        if (new_name)
+        {
+            debug (LEVEL_VERBOSE, "cached new name: %s\n", new_name);
+            g_free (action->new_name);
+            action->new_name = g_strdup (new_name);
+        }
+        g_mutex_unlock (&rules_cache->mutex);
+        if (new_name)
+        {
+            return;
+        }
+        cached = g_strdup (action->new_name);
+    }
     
     /* run rules and get the new name */
-    new_name = NULL;
-    for (l = commands; l; l = l->next)
+    g_private_set (&cur_action, action);
+    bufs = buffer_get_pair ();
+    name = action->new_name;
+    len = strlen (name);
+    for (l = commands; l != end; l = l->next)
     {
         command = l->data;
-        debug (LEVEL_DEBUG, "running rule %s on %s\n", command->rule->name,
-               action->new_name);
-        if (G_LIKELY (command->rule->run (&(command->data),
-                                            action->new_name,
-                                            &new_name,
-                                            &local_err)))
-        {
-            /* did we get a new name? */
-            if (new_name)
+        if (command->endif)
+        {
+            if (!rule_guard_match (command->data, name, len))
             {
-                debug (LEVEL_VERBOSE, "new name: %s\n", new_name);
-                g_free (action->new_name);
-                action->new_name = new_name;
-                new_name = NULL;
+                debug (LEVEL_DEBUG, "guard %s not matched by %s, skipping\n",
+                       command->rule->name, name);
+                l = command->endif;
             }
-            /* should we resolve variables? */
-            if (command->rule->resolve_variables)
+            continue;
+        }
+        out = get_out_buf (bufs, name);
+        debug (LEVEL_DEBUG, "running rule %s on %s\n", command->rule->name,
+               name);
+        result = run_rule (command, name, len, out, &local_err);
+        if (!take_result (action, command, result, local_err, bufs,
+                          &name, &len))
+        {
+            break;
+        }
+    }
+    /* only the last name is kept */
+    set_new_name (action, name, len);
+    g_private_set (&cur_action, NULL);
+    if (cached)
+    {
+        if (action->new_name)
+        {
+            g_mutex_lock (&rules_cache->mutex);
+            if (g_hash_table_size (rules_cache->names) >= MAX_RULES_CACHE)
             {
-                debug (LEVEL_DEBUG, "parsing variables\n");
-                has_resolved_variables = TRUE;
-                if (G_LIKELY (resolve_variables (action, &new_name, &local_err)))
-                {
-                    debug (LEVEL_VERBOSE, "new name: %s\n", new_name);
-                    g_free (action->new_name);
-                    action->new_name = new_name;
-                    new_name = NULL;
-                }
-                else
-                {
-                    error (ERROR_RULE_FAILED, "%s: failed to resolve variables: %s\n",
-                           action->file, local_err->message);
-                    g_clear_error (&local_err);
-                    /* we can't continue processing this action now */
-                    g_free (action->new_name);
-                    action->new_name = NULL;
-                    break;
-                }
+                g_hash_table_remove_all (rules_cache->names);
             }
+            g_hash_table_replace (rules_cache->names, cached,
+                                  g_strdup (action->new_name));
+            g_mutex_unlock (&rules_cache->mutex);
         }
         else
         {
-            error (ERROR_RULE_FAILED, "%s: rule %s failed: %s\n",
-                   action->file, command->rule->name, local_err->message);
-            g_clear_error (&local_err);
-            /* we can't continue processing this action now */
-            g_free (action->new_name);
-            action->new_name = NULL;
-            break;
+            g_free (cached);
         }
     }
+    if (!end)
+    {
+        clear_var_per_file (action);
+    }
+}
+
+/* whether there's already an action for the file of action, in files or
+ * (under another path) in by_inode */
+static gboolean
+is_duplicate (action_t *action, GHashTable *files, GHashTable *by_inode)
+{
+    action_t *a;
+    
+    /* make sure there isn't already an action for this file */
+    if (g_hash_table_lookup (files, (gpointer) &action->file))
+    {
+        debug (LEVEL_DEBUG, "already an action for this file, aborting\n");
+        return TRUE;
+    }
+    /* or for the same file under another path. Hard links are different files
+     * (that do share an inode) so only directories, and files with a single
+     * link, are checked */
+    if ((S_ISDIR (action->mode) || action->nlink == 1)
+            && (a = g_hash_table_lookup (by_inode, (gpointer) action)))
+    {
+        debug (LEVEL_DEBUG, "same file as %s/%s, aborting\n",
+               PATH_ARGS (&a->file));
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* adds action (which rules before commands were applied to, if any) to the
+ * list, once the rules are all applied & its new name checked. Must be called
+ * in input order, from the main thread */
+static void
+add_action (action_t *action, GSList *commands, GSList **actions_list)
+{
+    static guint cur = 0;
+    gboolean     is_unique_inode;
+    
+    /* in streaming mode, actions are processed one directory at a time */
+    if (streaming && action->file.dir != stream_dir)
+    {
+        if (*actions_list)
+        {
+            flush_actions (actions_list);
+        }
+        stream_dir = action->file.dir;
+    }
+    if (is_duplicate (action, actions, inodes))
+    {
+        free_action (action);
+        return;
+    }
+    is_unique_inode = S_ISDIR (action->mode) || action->nlink == 1;
+    action->cur = ++cur;
+    
+    apply_rules (action, commands, NULL);
     debug (LEVEL_DEBUG, "all commands applied\n");
-    if (has_resolved_variables)
+    if (G_UNLIKELY (action->error))
     {
-        /* clear cache of per-file values */
-        g_hash_table_destroy (var_per_file);
-        /* recreates an empty hashmap */
-        var_per_file = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                              (GDestroyNotify) g_free,
-                                              (GDestroyNotify) g_free);
+        error (ERROR_RULE_FAILED, "%s", action->error);
+        g_free (action->error);
+        action->error = NULL;
     }
     /* check whether we actually have a new name or not */
-    if (action->new_name && g_strcmp0 (action->new_name,
-            (process_fullname) ? action->file : action->filename) != 0)
+    if (action->new_name && ((process_fullname)
+                ? !path_is (&action->file, action->new_name)
+                : strcmp (action->new_name, action->file.name) != 0))
     {
         /* check validity of new name */
         gboolean is_valid = (strlen (action->new_name) > 0);
@@ -1263,50 +1807,543 @@ add_action_for_file (gchar *file, GFileTest test_types,
         
         if (!is_valid)
         {
-            error (ERROR_INVALID_NAME, "%s: invalid new name: %s\n",
-                   action->file, action->new_name);
+            error (ERROR_INVALID_NAME, "%s/%s: invalid new name: %s\n",
+                   PATH_ARGS (&action->file), action->new_name);
             g_free (action->new_name);
             action->new_name = NULL;
         }
         else
         {
-            /* set the fullname and pointer to the filename */
-            if (action->new_name[0] == '/')
-            {
-                new_name = action->new_name;
-            }
-            else
-            {
-                gchar *s;
-                /* because the action isn't necessarily for one in curdir, we
-                 * need to prefix it with its own path.
-                 * action->filename is a pointer to the first char of the
-                 * filename inside action->file, so we turn the / before into
-                 * a NULL to get the path, and then restore it. */
-                s = action->filename - 1;
-                *s = '\0';
-                new_name = g_strconcat (action->file, "/", action->new_name, NULL);
-                *s = '/';
-                g_free (action->new_name);
-            }
-            set_full_file_name (new_name, &(action->new_name), &(action->new_filename));
-            g_free (new_name);
-            
-            debug (LEVEL_DEBUG, "new name: %s\n", action->new_name);
-            set_to_rename (action, action);
+            if (!strchr (action->new_name, '/'))
+            {
+                /* simply a new name in the same directory */
+                action->new_file.dir = action->file.dir;
+                action->new_file.name = action->new_name;
+            }
+            else
+            {
+                /* because the action isn't necessarily for one in curdir,
+                 * the new name is relative to its own directory */
+                set_path (action->new_name, action->file.dir->path,
+                          &action->new_file);
+                g_free (action->new_name);
+            }
+            action->new_name = NULL;
+            
+            debug (LEVEL_DEBUG, "new name: %s/%s\n", PATH_ARGS (&action->new_file));
+            /* in streaming mode, conflicts are only checked within the
+             * directory, so files can't be moved out of it */
+            if (streaming && action->new_file.dir != action->file.dir)
+            {
+                error (ERROR_INVALID_NAME, "%s/%s: invalid new name (not in the "
+                       "same directory): %s/%s\n", PATH_ARGS (&action->file),
+                       PATH_ARGS (&action->new_file));
+                g_free (action->new_file.name);
+                action->new_file.name = NULL;
+            }
+            else
+            {
+                set_to_rename (action, action);
+            }
+        }
+    }
+    else
+    {
+        debug (LEVEL_DEBUG, "no new name\n");
+        /* no new name, we can free this */
+        g_free (action->new_name);
+        action->new_name = NULL;
+    }
+    /* add action to hashmap (for easy access) */
+    g_hash_table_insert (actions, (gpointer) &action->file, (gpointer) action);
+    if (is_unique_inode)
+    {
+        g_hash_table_insert (inodes, (gpointer) action, (gpointer) action);
+    }
+    /* and in list, to preserve order (when processing) */
+    *actions_list = g_slist_append (*actions_list, (gpointer) action);
+}
+
+/* applies commands from first up to last (excluded), none running on batches,
+ * to the i-th action of the batch */
+static void
+apply_batch_commands (rules_batch_t *batch,
+                      guint          i,
+                      GSList        *first,
+                      GSList        *last)
+{
+    GError        *local_err = NULL;
+    command_t     *command;
+    action_t      *action;
+    GSList        *l;
+    rule_result_t  result;
+    
+    action = g_ptr_array_index (batch->actions, i);
+    g_private_set (&cur_action, action);
+    for (l = first; l != last && !action->error; l = l->next)
+    {
+        command = l->data;
+        if (batch->skips[i] == l)
+        {
+            batch->skips[i] = NULL;
+        }
+        else if (batch->skips[i])
+        {
+            continue;
+        }
+        
+        if (command->endif)
+        {
+            if (!rule_guard_match (command->data, batch->names[i],
+                                   batch->lens[i]))
+            {
+                debug (LEVEL_DEBUG, "guard %s not matched by %s, skipping\n",
+                       command->rule->name, batch->names[i]);
+                batch->skips[i] = command->endif;
+            }
+            continue;
+        }
+        debug (LEVEL_DEBUG, "running rule %s on %s\n",
+               command->rule->name, batch->names[i]);
+        result = run_rule (command, batch->names[i], batch->lens[i],
+                           get_out_buf (&batch->bufs[2 * i], batch->names[i]),
+                           &local_err);
+        take_result (action, command, result, local_err,
+                     &batch->bufs[2 * i], &batch->names[i], &batch->lens[i]);
+        local_err = NULL;
+    }
+}
+
+/* applies the commands of the batch to all its actions, then adds them. Rules
+ * running on batches get all names at once. Others are applied file by file
+ * (in input order) up to the next such rule, so they're called in the same
+ * order as without batches */
+static void
+add_batched_actions (GSList **actions_list)
+{
+    rules_batch_t     *batch = rules_batch;
+    rule_batch_item_t *item;
+    GError            *local_err = NULL;
+    command_t         *command;
+    action_t          *action;
+    GSList            *l;
+    GSList            *next;
+    guint              i;
+    guint              n;
+    
+    debug (LEVEL_DEBUG, "applying rules to a batch of %u files\n",
+           batch->actions->len);
+    for (i = 0; i < batch->actions->len; ++i)
+    {
+        action = g_ptr_array_index (batch->actions, i);
+        init_new_name (action);
+        batch->names[i] = action->new_name;
+        batch->lens[i] = strlen (action->new_name);
+        batch->skips[i] = NULL;
+    }
+    
+    /* actions skipping rules (up to an endif) are left out */
+#define for_each_action()                                               \
+    for (i = 0; i < batch->actions->len; ++i)                           \
+        if (!(action = g_ptr_array_index (batch->actions, i))->error    \
+                && !batch->skips[i])
+    
+    for (l = batch->commands; l; l = next)
+    {
+        command = l->data;
+        if (!command->rule->run_batch)
+        {
+            for (next = l->next;
+                    next && !((command_t *) next->data)->rule->run_batch;
+                    next = next->next)
+            {
+            }
+            for (i = 0; i < batch->actions->len; ++i)
+            {
+                apply_batch_commands (batch, i, l, next);
+            }
+            continue;
+        }
+        
+        next = l->next;
+        for (i = 0; i < batch->actions->len; ++i)
+        {
+            if (batch->skips[i] == l)
+            {
+                batch->skips[i] = NULL;
+            }
+        }
+        n = 0;
+        for_each_action ()
+        {
+            item = &batch->items[n++];
+            item->name = batch->names[i];
+            item->len = batch->lens[i];
+            item->out = get_out_buf (&batch->bufs[2 * i], batch->names[i]);
+            item->result = RULE_RESULT_UNCHANGED;
+            item->error = NULL;
+        }
+        if (n == 0)
+        {
+            continue;
+        }
+        debug (LEVEL_DEBUG, "running rule %s on %u names\n",
+               command->rule->name, n);
+        /* values of per-file variables can't be set for a batch */
+        g_private_set (&cur_action, NULL);
+        if (G_UNLIKELY (!command->rule->run_batch (&(command->data),
+                                                   batch->items, n,
+                                                   &local_err)))
+        {
+            for (item = batch->items; item < batch->items + n; ++item)
+            {
+                item->result = RULE_RESULT_ERROR;
+                g_clear_error (&item->error);
+                item->error = g_error_copy (local_err);
+            }
+            g_clear_error (&local_err);
+        }
+        
+        item = batch->items;
+        for_each_action ()
+        {
+            g_private_set (&cur_action, action);
+            take_result (action, command, item->result, item->error,
+                         &batch->bufs[2 * i], &batch->names[i],
+                         &batch->lens[i]);
+            ++item;
+        }
+    }
+    g_private_set (&cur_action, NULL);
+    
+#undef for_each_action
+    
+    for (i = 0; i < batch->actions->len; ++i)
+    {
+        action = g_ptr_array_index (batch->actions, i);
+        set_new_name (action, batch->names[i], batch->lens[i]);
+        clear_var_per_file (action);
+        add_action (action, NULL, actions_list);
+    }
+    g_ptr_array_set_size (batch->actions, 0);
+    g_hash_table_remove_all (batch->files);
+    g_hash_table_remove_all (batch->inodes);
+}
+
+/* adds action, which rules before commands were applied to (if any). With rules
+ * running on batches, it's only added once its batch is full */
+static void
+add_action_batched (action_t *action, GSList *commands, GSList **actions_list)
+{
+    if (!rules_batch)
+    {
+        add_action (action, commands, actions_list);
+        return;
+    }
+    
+    /* duplicates are checked now, so rules don't run on them */
+    if (is_duplicate (action, actions, inodes)
+            || is_duplicate (action, rules_batch->files, rules_batch->inodes))
+    {
+        free_action (action);
+        return;
+    }
+    g_hash_table_add (rules_batch->files, (gpointer) &action->file);
+    if (S_ISDIR (action->mode) || action->nlink == 1)
+    {
+        g_hash_table_add (rules_batch->inodes, (gpointer) action);
+    }
+    g_ptr_array_add (rules_batch->actions, (gpointer) action);
+    if (rules_batch->actions->len == rules_batch->size)
+    {
+        add_batched_actions (actions_list);
+    }
+}
+
+/* applies (in a thread) the rules that can be, to the action of job */
+static void
+rules_thread (rules_job_t *job, rules_pool_t *pool)
+{
+    apply_rules (job->action, pool->commands, pool->commands_seq);
+    
+    g_mutex_lock (&pool->mutex);
+    job->done = TRUE;
+    g_cond_signal (&pool->cond);
+    g_mutex_unlock (&pool->mutex);
+}
+
+/* adds actions whose rules were applied on the pool, in input order. If wait
+ * is TRUE, waits for all of them, else only if there's too many pending */
+static void
+add_pooled_actions (gboolean wait, GSList **actions_list)
+{
+    rules_job_t *job;
+    
+    g_mutex_lock (&rules_pool->mutex);
+    while ((job = g_queue_peek_head (&rules_pool->jobs)))
+    {
+        if (!job->done)
+        {
+            if (!wait && rules_pool->jobs.length < MAX_RULES_JOBS)
+            {
+                break;
+            }
+            g_cond_wait (&rules_pool->cond, &rules_pool->mutex);
+            continue;
+        }
+        g_queue_pop_head (&rules_pool->jobs);
+        g_mutex_unlock (&rules_pool->mutex);
+        
+        add_action_batched (job->action, rules_pool->commands_seq,
+                            actions_list);
+        g_slice_free (rules_job_t, job);
+        
+        g_mutex_lock (&rules_pool->mutex);
+    }
+    g_mutex_unlock (&rules_pool->mutex);
+}
+
+/* st is the result of lstat() on file if it was already done (e.g. while
+ * walking directories), else NULL */
+static void
+add_action_for_file (gchar *file, struct stat *st, GFileTest test_types,
+                     GSList *commands, GSList **actions_list)
+{
+    action_t    *action;
+    rules_job_t *job;
+    struct stat  st_file;
+    GFileTest    type;
+    
+    /* this is the only time we stat the file, everything we need to know
+     * about it comes from there */
+    if (!st)
+    {
+        if (lstat (file, &st_file) != 0)
+        {
+            if (errno == ENOENT || errno == ENOTDIR)
+            {
+                error (ERROR_FILE, "file does not exist: %s\n", file);
+            }
+            else
+            {
+                error (ERROR_FILE, "unable to stat %s: %s\n", file,
+                       strerror (errno));
+            }
+            return;
+        }
+        st = &st_file;
+    }
+    type = get_file_type (st->st_mode);
+    
+    if (test_types == (G_FILE_TEST_IS_REGULAR | G_FILE_TEST_IS_DIR
+                        | G_FILE_TEST_IS_SYMLINK))
+    {
+        debug (LEVEL_DEBUG, "process: %s\n", file);
+    }
+    else if (test_types & type & G_FILE_TEST_IS_REGULAR)
+    {
+        debug (LEVEL_DEBUG, "process file: %s\n", file);
+    }
+    else if (test_types & type & G_FILE_TEST_IS_DIR)
+    {
+        debug (LEVEL_DEBUG, "process dir: %s\n", file);
+    }
+    else if (test_types & type & G_FILE_TEST_IS_SYMLINK)
+    {
+        debug (LEVEL_DEBUG, "process symlink: %s\n", file);
+    }
+    /* a symlink is also a file/dir if its target is. Only case where we need
+     * to stat more than once */
+    else if (type == G_FILE_TEST_IS_SYMLINK
+            && test_types & (G_FILE_TEST_IS_REGULAR | G_FILE_TEST_IS_DIR)
+            && stat (file, &st_file) == 0
+            && test_types & get_file_type (st_file.st_mode))
+    {
+        debug (LEVEL_DEBUG, "process symlink to file/dir: %s\n", file);
+    }
+    else
+    {
+        debug (LEVEL_DEBUG, "ignore: %s\n", file);
+        return;
+    }
+    
+    /* create new action */
+    action = g_slice_new0 (action_t);
+    action->mode = st->st_mode;
+    action->dev = st->st_dev;
+    action->ino = st->st_ino;
+    action->nlink = st->st_nlink;
+    action->size = st->st_size;
+    action->mtime = st->st_mtime;
+    /* make sure we have a filename */
+    if (!set_path (file, curdir, &action->file))
+    {
+        error (ERROR_SYNTAX, "%s/: no filename\n", action->file.dir->path);
+        free_action (action);
+        return;
+    }
+    
+    if (!rules_pool)
+    {
+        add_action_batched (action, commands, actions_list);
+        return;
+    }
+    
+    /* rules are applied on the pool, and the action added once done. We keep
+     * them in order, to add them in the same order */
+    job = g_slice_new0 (rules_job_t);
+    job->action = action;
+    g_mutex_lock (&rules_pool->mutex);
+    g_queue_push_tail (&rules_pool->jobs, job);
+    g_mutex_unlock (&rules_pool->mutex);
+    g_thread_pool_push (rules_pool->pool, job, NULL);
+    
+    add_pooled_actions (FALSE, actions_list);
+}
+
+/* whether file is to be processed as per the include/exclude patterns */
+static gboolean
+is_included (const gchar *file)
+{
+    const gchar *name;
+    gchar       *base;
+    gboolean     included;
+    
+    if (!filter)
+    {
+        return TRUE;
+    }
+    
+    name = strrchr (file, '/');
+    name = (name) ? name + 1 : file;
+    /* trailing slash, e.g. "dir/" */
+    if (G_UNLIKELY (*name == '\0' && name != file))
+    {
+        base = g_path_get_basename (file);
+        included = filter_match (filter, base);
+        g_free (base);
+    }
+    else
+    {
+        included = filter_match (filter, name);
+    }
+    
+    if (!included)
+    {
+        debug (LEVEL_DEBUG, "filtered out: %s\n", file);
+    }
+    return included;
+}
+
+static void
+walk_add_action (gint         dirfd,
+                 gchar       *file,
+                 const gchar *name,
+                 GFileTest    type,
+                 struct stat *st,
+                 gpointer     data)
+{
+    walk_data_t *walk_data = data;
+    struct stat  st_file;
+    
+    /* if we can tell already it'll be ignored, no need to stat. (Symlinks
+     * might be a file/dir, as per their target) */
+    if (type != 0 && type != G_FILE_TEST_IS_SYMLINK
+            && walk_data->test_types != (G_FILE_TEST_IS_REGULAR
+                | G_FILE_TEST_IS_DIR | G_FILE_TEST_IS_SYMLINK)
+            && !(walk_data->test_types & type))
+    {
+        debug (LEVEL_DEBUG, "ignore: %s\n", file);
+        return;
+    }
+    
+    if (!st)
+    {
+        /* when reading in threads, the walker tried already, so this will
+         * fail again, but we get the error */
+        if (fstatat (dirfd, name, &st_file, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            error (ERROR_FILE, "unable to stat %s: %s\n", file, strerror (errno));
+            return;
+        }
+        st = &st_file;
+    }
+    add_action_for_file (file, st, walk_data->test_types,
+                         walk_data->commands, walk_data->actions_list);
+}
+
+static void
+walk_error (const gchar *path, const gchar *message, gpointer data _UNUSED_)
+{
+    error (ERROR_FILE, "%s: unable to read directory: %s\n", path, message);
+}
+
+/* st is the result of lstat() on file if it was already done (e.g. by the
+ * prefetcher), else NULL */
+static void
+add_actions_for_file (gchar *file, struct stat *st, walk_t *walk,
+                      GFileTest test_types, GSList *commands,
+                      GSList **actions_list)
+{
+    GError      *local_err = NULL;
+    struct stat  st_file;
+    
+    if (walk && !st && lstat (file, &st_file) == 0)
+    {
+        st = &st_file;
+    }
+    
+    /* symlinks to directories specified are followed */
+    if (walk && st && (S_ISDIR (st->st_mode) || S_ISLNK (st->st_mode))
+            && !walk_tree (walk, file, &local_err))
+    {
+        /* a symlink to something else is fine, we just have nothing to walk */
+        if (local_err->code != ENOTDIR && local_err->code != ENOENT)
+        {
+            error (ERROR_FILE, "%s: unable to read directory: %s\n",
+                   file, local_err->message);
         }
+        g_clear_error (&local_err);
+    }
+    /* when walking, filters weren't checked yet since we needed to get to
+     * the content */
+    if (walk && !is_included (file))
+    {
+        return;
+    }
+    /* add_action_for_file will stat (and report the error) if needed */
+    add_action_for_file (file, st, test_types, commands, actions_list);
+}
+
+static void
+prefetch_add_actions (gchar *file, struct stat *st, gpointer data)
+{
+    walk_data_t *walk_data = data;
+    
+    add_actions_for_file (file, st, walk_data->walk, walk_data->test_types,
+                          walk_data->commands, walk_data->actions_list);
+}
+
+/* adds actions for file specified on command line or stdin, through the
+ * prefetcher if any */
+static void
+add_input_file (gchar *file, prefetch_t *prefetch, walk_data_t *walk_data)
+{
+    /* unless walking, no need to go further for files filtered out */
+    if (!walk_data->walk && !is_included (file))
+    {
+        return;
+    }
+    
+    if (prefetch)
+    {
+        prefetch_add (prefetch, file);
     }
     else
     {
-        debug (LEVEL_DEBUG, "no new name\n");
-        /* no new name, we can free this */
-        g_free (action->new_name);
-        action->new_name = NULL;
+        add_actions_for_file (file, NULL, walk_data->walk, walk_data->test_types,
+                              walk_data->commands, walk_data->actions_list);
     }
-    /* add action to hashmap (for easy access) */
-    g_hash_table_insert (actions, (gpointer) action->file, (gpointer) action);
-    /* and in list, to preserve order (when processing) */
-    *actions_list = g_slist_append (*actions_list, (gpointer) action);
 }
 
 int
@@ -1321,6 +2358,7 @@ main (int argc, char **argv)
     gchar         *file;
     
     GSList        *commands = NULL;
+    GSList        *guards = NULL;   /* guards whose group isn't over */
     command_t     *command;
     GPtrArray     *ptr_arr;
     guint          i;
@@ -1329,16 +2367,20 @@ main (int argc, char **argv)
     gchar         *option;
     GFileTest      test_types = G_FILE_TEST_IS_REGULAR | G_FILE_TEST_IS_DIR
                                 | G_FILE_TEST_IS_SYMLINK;
-    gboolean       continue_on_error = FALSE;
-    gboolean       dry_run           = FALSE;
-    output_t       output            = OUTPUT_STANDARD;
-    gboolean       only_rules        = FALSE;
+    process_t      process           = { OUTPUT_STANDARD, FALSE, FALSE, FALSE,
+                                             FALSE };
     gboolean       from_stdin        = FALSE;
-    gboolean       make_parents      = FALSE;
+    gboolean       recursive         = FALSE;
+    gint           max_depth         = -1;
+    gint           jobs              = 1;
+    gint           queue_depth       = 0;
+    gint           batch_size        = DEFAULT_BATCH_SIZE;
+    prefetch_t    *prefetch          = NULL;
+    walk_t         walk;
+    walk_data_t    walk_data;
+    gchar         *value;
     
     GSList        *actions_list      = NULL;
-    action_t      *action;
-    GSList        *l;
     
     /* try to get debug option now so it applies to loading rules as well.
      * Note: only works if the first option is -d[d] (--debug not supported) */
@@ -1364,9 +2406,11 @@ main (int argc, char **argv)
     rule->help = NULL;
     rule->param = PARAM_NONE;
     rule->init = NULL;
-    rule->run = rule_to_lower;
+    rule->run = NULL;
     rule->destroy = NULL;
     rule->resolve_variables = FALSE;
+    rule->flags = RULE_FLAG_THREAD_SAFE | RULE_FLAG_PURE;
+    rule->run_buf = rule_to_lower;
     add_rule (rule);
     
     rule->name = "upper";
@@ -1374,9 +2418,11 @@ main (int argc, char **argv)
     rule->help = NULL;
     rule->param = PARAM_NONE;
     rule->init = NULL;
-    rule->run = rule_to_upper;
+    rule->run = NULL;
     rule->destroy = NULL;
     rule->resolve_variables = FALSE;
+    rule->flags = RULE_FLAG_THREAD_SAFE | RULE_FLAG_PURE;
+    rule->run_buf = rule_to_upper;
     add_rule (rule);
     
     rule->name = "camel";
@@ -1384,9 +2430,11 @@ main (int argc, char **argv)
     rule->help = NULL;
     rule->param = PARAM_NONE;
     rule->init = NULL;
-    rule->run = rule_camel;
+    rule->run = NULL;
     rule->destroy = NULL;
     rule->resolve_variables = FALSE;
+    rule->flags = RULE_FLAG_THREAD_SAFE | RULE_FLAG_PURE;
+    rule->run_buf = rule_camel;
     add_rule (rule);
     
     rule->name = "sr";
@@ -1396,9 +2444,27 @@ main (int argc, char **argv)
         "Search is case-sensitive, unless option i was specified.";
     rule->param = PARAM_SPLIT;
     rule->init = rule_sr_init;
-    rule->run = (rule_run_fn) rule_sr;
+    rule->run = NULL;
     rule->destroy = rule_sr_destroy;
     rule->resolve_variables = FALSE;
+    rule->flags = RULE_FLAG_THREAD_SAFE | RULE_FLAG_PURE;
+    rule->run_buf = rule_sr;
+    add_rule (rule);
+    
+    rule->name = "dict";
+    rule->description = "Search & replace strings from a file";
+    rule->help = "PARAM = file\n"
+        "Each line of the file is a string to search for, optionally followed\n"
+        "by a tab and its replacement. Without one, the string will be removed.\n"
+        "All strings are searched for at once, the longest one winning when\n"
+        "several match at the same position.";
+    rule->param = PARAM_NO_SPLIT;
+    rule->init = rule_dict_init;
+    rule->run = NULL;
+    rule->destroy = rule_dict_destroy;
+    rule->resolve_variables = FALSE;
+    rule->flags = RULE_FLAG_THREAD_SAFE | RULE_FLAG_PURE;
+    rule->run_buf = rule_dict;
     add_rule (rule);
     
     rule->name = "list";
@@ -1406,9 +2472,26 @@ main (int argc, char **argv)
     rule->help = NULL;
     rule->param = PARAM_NONE;
     rule->init = rule_list_init;
-    rule->run = rule_list;
-    rule->destroy = NULL;
+    rule->run = NULL;
+    rule->destroy = rule_list_destroy;
     rule->resolve_variables = FALSE;
+    rule->flags = 0;
+    rule->run_buf = rule_list;
+    add_rule (rule);
+    
+    rule->name = "map";
+    rule->description = "Use new names from a table of old & new names";
+    rule->help = "PARAM = file\n"
+        "Each line of the file is an old name, a tab and its new name. If the\n"
+        "file contains NULL characters, old & new names are instead all\n"
+        "separated by NULLs. Names not in the table are left unchanged.";
+    rule->param = PARAM_NO_SPLIT;
+    rule->init = rule_map_init;
+    rule->run = NULL;
+    rule->destroy = rule_map_destroy;
+    rule->resolve_variables = FALSE;
+    rule->flags = RULE_FLAG_THREAD_SAFE | RULE_FLAG_PURE;
+    rule->run_buf = rule_map;
     add_rule (rule);
     
     rule->name = "regex";
@@ -1418,9 +2501,11 @@ main (int argc, char **argv)
         "Search is case-sensitive, unless option i was specified.";
     rule->param = PARAM_SPLIT;
     rule->init = rule_regex_init;
-    rule->run = rule_regex;
+    rule->run = NULL;
     rule->destroy = rule_regex_destroy;
     rule->resolve_variables = FALSE;
+    rule->flags = RULE_FLAG_THREAD_SAFE | RULE_FLAG_PURE;
+    rule->run_buf = rule_regex;
     add_rule (rule);
     
     rule->name = "vars";
@@ -1428,9 +2513,11 @@ main (int argc, char **argv)
     rule->help = NULL;
     rule->param = PARAM_NONE;
     rule->init = NULL;
-    rule->run = rule_variables;
+    rule->run = NULL;
     rule->destroy = NULL;
     rule->resolve_variables = TRUE;
+    rule->flags = 0;
+    rule->run_buf = rule_variables;
     add_rule (rule);
     
     rule->name = "tpl";
@@ -1438,9 +2525,68 @@ main (int argc, char **argv)
     rule->help = NULL;
     rule->param = PARAM_NO_SPLIT;
     rule->init = rule_tpl_init;
-    rule->run = rule_tpl;
-    rule->destroy = NULL;
+    rule->run = NULL;
+    rule->destroy = rule_tpl_destroy;
     rule->resolve_variables = TRUE;
+    rule->flags = 0;
+    rule->run_buf = rule_tpl;
+    add_rule (rule);
+    
+    rule->name = "if-glob";
+    rule->description = "Only apply the next rules to names matching a glob";
+    rule->help = "PARAM = glob[/option]\n"
+        "Rules up to the matching --endif (or the last one) are skipped for\n"
+        "names not matching glob. Matching is case-sensitive, unless option i\n"
+        "was specified.";
+    rule->param = PARAM_SPLIT;
+    rule->init = rule_if_glob_init;
+    rule->run = NULL;
+    rule->destroy = rule_guard_destroy;
+    rule->resolve_variables = FALSE;
+    rule->flags = RULE_FLAG_THREAD_SAFE | RULE_FLAG_PURE;
+    rule->run_buf = rule_guard;
+    add_rule (rule);
+    
+    rule->name = "if-has";
+    rule->description = "Only apply the next rules to names with a string";
+    rule->help = "PARAM = string[/option]\n"
+        "Rules up to the matching --endif (or the last one) are skipped for\n"
+        "names not containing string. Search is case-sensitive, unless option\n"
+        "i was specified.";
+    rule->param = PARAM_SPLIT;
+    rule->init = rule_if_has_init;
+    rule->run = NULL;
+    rule->destroy = rule_guard_destroy;
+    rule->resolve_variables = FALSE;
+    rule->flags = RULE_FLAG_THREAD_SAFE | RULE_FLAG_PURE;
+    rule->run_buf = rule_guard;
+    add_rule (rule);
+    
+    rule->name = "if-ext";
+    rule->description = "Only apply the next rules to names with an extension";
+    rule->help = "PARAM = ext[,ext...][/option]\n"
+        "Rules up to the matching --endif (or the last one) are skipped for\n"
+        "names whose extension isn't one of those listed. Comparison is\n"
+        "case-sensitive, unless option i was specified.";
+    rule->param = PARAM_SPLIT;
+    rule->init = rule_if_ext_init;
+    rule->run = NULL;
+    rule->destroy = rule_guard_destroy;
+    rule->resolve_variables = FALSE;
+    rule->flags = RULE_FLAG_THREAD_SAFE | RULE_FLAG_PURE;
+    rule->run_buf = rule_guard;
+    add_rule (rule);
+    
+    rule->name = "endif";
+    rule->description = "End the group of rules of the last --if-* rule";
+    rule->help = NULL;
+    rule->param = PARAM_NONE;
+    rule->init = NULL;
+    rule->run = NULL;
+    rule->destroy = NULL;
+    rule->resolve_variables = FALSE;
+    rule->flags = RULE_FLAG_THREAD_SAFE | RULE_FLAG_PURE;
+    rule->run_buf = rule_endif;
     add_rule (rule);
     
     g_free (rule);
@@ -1498,7 +2644,9 @@ main (int argc, char **argv)
             &get_stdin,
             &add_rule,
             &add_var,
-            &add_var_value
+            &add_var_value,
+            &buffer_reserve,
+            &buffer_append
         };
         
         while ((filename = g_dir_read_name (dir)))
@@ -1560,7 +2708,9 @@ main (int argc, char **argv)
             
             get_symbol ("plugin_init", init, TRUE);
             debug (LEVEL_VERBOSE, "call plugin's init\n");
+            plugin_api = req_api;
             init ();
+            plugin_api = 0;
             
             /* store ref to this plugin */
             plugin->priv->file = g_strdup (file);
@@ -1588,10 +2738,10 @@ main (int argc, char **argv)
                     debug (LEVEL_DEBUG, "debug level: %d\n", level);
                     break;
                 case OPT_CONTINUE_ON_ERROR:
-                    continue_on_error = TRUE;
+                    process.continue_on_error = TRUE;
                     break;
                 case OPT_DRY_RUN:
-                    dry_run = TRUE;
+                    process.dry_run = TRUE;
                     break;
                 case OPT_EXCLUDE_DIRS:
                     test_types ^= G_FILE_TEST_IS_DIR;
@@ -1603,18 +2753,18 @@ main (int argc, char **argv)
                     test_types ^= G_FILE_TEST_IS_SYMLINK;
                     break;
                 case OPT_OUTPUT_BOTH:
-                    output = OUTPUT_BOTH_NAMES;
+                    process.output = OUTPUT_BOTH_NAMES;
                     break;
                 case OPT_OUTPUT_NEW:
-                    output = OUTPUT_NEW_NAMES;
+                    process.output = OUTPUT_NEW_NAMES;
                     break;
                 case OPT_OUTPUT_FULLNAME:
                     output_fullname = TRUE;
                     break;
                 case OPT_ONLY_RULES:
-                    only_rules = TRUE;
+                    process.only_rules = TRUE;
                     debug (LEVEL_DEBUG, "implied option --dry-run\n");
-                    dry_run = TRUE;
+                    process.dry_run = TRUE;
                     break;
                 case OPT_PROCESS_FULLNAME:
                     process_fullname = TRUE;
@@ -1629,6 +2779,113 @@ main (int argc, char **argv)
                 case OPT_FROM_STDIN:
                     from_stdin = TRUE;
                     break;
+                case OPT_NULL:
+                    stdin_delim = '\0';
+                    break;
+                case OPT_INCLUDE:
+                case OPT_EXCLUDE:
+                case OPT_INCLUDE_REGEX:
+                case OPT_EXCLUDE_REGEX:
+                    value = get_option_value (argc, argv, &argi);
+                    if (G_UNLIKELY (!value))
+                    {
+                        error (ERROR_SYNTAX, "missing value for option --%s\n",
+                               (*option == OPT_INCLUDE) ? "include"
+                               : (*option == OPT_EXCLUDE) ? "exclude"
+                               : (*option == OPT_INCLUDE_REGEX) ? "include-regex"
+                               : "exclude-regex");
+                        break;
+                    }
+                    if (!filter)
+                    {
+                        filter = filter_new ();
+                    }
+                    if (*option == OPT_INCLUDE || *option == OPT_EXCLUDE)
+                    {
+                        filter_add_glob (filter, (*option == OPT_INCLUDE)
+                                         ? FILTER_INCLUDE : FILTER_EXCLUDE, value);
+                    }
+                    else if (!filter_add_regex (filter, (*option == OPT_INCLUDE_REGEX)
+                                ? FILTER_INCLUDE : FILTER_EXCLUDE, value, &local_err))
+                    {
+                        error (ERROR_SYNTAX, "invalid regex for option --%s: %s\n",
+                               (*option == OPT_INCLUDE_REGEX) ? "include-regex"
+                               : "exclude-regex", local_err->message);
+                        g_clear_error (&local_err);
+                    }
+                    break;
+                case OPT_RECURSIVE:
+                    recursive = TRUE;
+                    break;
+                case OPT_MAX_DEPTH:
+                    value = get_option_value (argc, argv, &argi);
+                    if (G_UNLIKELY (!value))
+                    {
+                        error (ERROR_SYNTAX, "missing value for option --%s\n",
+                               "max-depth");
+                        break;
+                    }
+                    max_depth = (gint) strtol (value, &value, 10);
+                    if (G_UNLIKELY (*value != '\0' || max_depth < 0))
+                    {
+                        error (ERROR_SYNTAX, "invalid value for option --%s\n",
+                               "max-depth");
+                        break;
+                    }
+                    debug (LEVEL_DEBUG, "implied option --recursive\n");
+                    recursive = TRUE;
+                    break;
+                case OPT_JOBS:
+                    value = get_option_value (argc, argv, &argi);
+                    if (G_UNLIKELY (!value))
+                    {
+                        error (ERROR_SYNTAX, "missing value for option --%s\n",
+                               "jobs");
+                        break;
+                    }
+                    jobs = (gint) strtol (value, &value, 10);
+                    if (G_UNLIKELY (*value != '\0' || jobs < 1))
+                    {
+                        error (ERROR_SYNTAX, "invalid value for option --%s\n",
+                               "jobs");
+                        break;
+                    }
+                    break;
+                case OPT_STREAM:
+                    streaming = &process;
+                    break;
+                case OPT_QUEUE_DEPTH:
+                    value = get_option_value (argc, argv, &argi);
+                    if (G_UNLIKELY (!value))
+                    {
+                        error (ERROR_SYNTAX, "missing value for option --%s\n",
+                               "queue-depth");
+                        break;
+                    }
+                    queue_depth = (gint) strtol (value, &value, 10);
+                    if (G_UNLIKELY (*value != '\0' || queue_depth < 0))
+                    {
+                        error (ERROR_SYNTAX, "invalid value for option --%s\n",
+                               "queue-depth");
+                        break;
+                    }
+                    break;
+                case OPT_BATCH_SIZE:
+                    value = get_option_value (argc, argv, &argi);
+                    if (G_UNLIKELY (!value))
+                    {
+                        error (ERROR_SYNTAX, "missing value for option --%s\n",
+                               "batch-size");
+                        break;
+                    }
+                    batch_size = (gint) strtol (value, &value, 10);
+                    if (G_UNLIKELY (*value != '\0' || batch_size < 1))
+                    {
+                        error (ERROR_SYNTAX, "invalid value for option --%s\n",
+                               "batch-size");
+                        break;
+                    }
+                    break;
                 case OPT_HELP:
                     ++help;
                     break;
@@ -1636,7 +2893,7 @@ main (int argc, char **argv)
                     ++version;
                     break;
                 case OPT_MAKE_PARENTS:
-                    make_parents = TRUE;
+                    process.make_parents = TRUE;
                     break;
             }
         }
@@ -1710,6 +2967,25 @@ main (int argc, char **argv)
                 {
                     do_resolve_variables = TRUE;
                 }
+                /* groups of guarded rules */
+                if (command->rule->run_buf == rule_guard)
+                {
+                    guards = g_slist_prepend (guards, command);
+                }
+                else if (command->rule->run_buf == rule_endif)
+                {
+                    if (G_UNLIKELY (!guards))
+                    {
+                        error (ERROR_SYNTAX, "rule %s without a guard\n",
+                               command->rule->name);
+                    }
+                    else
+                    {
+                        ((command_t *) guards->data)->endif =
+                            g_slist_last (commands);
+                        guards = g_slist_delete_link (guards, guards);
+                    }
+                }
             }
             
             ++argi;
@@ -1719,6 +2995,17 @@ main (int argc, char **argv)
     {
         error (ERROR_SYNTAX, "unknown option: %c\n", *option);
     }
+    /* groups still open end with the rules */
+    if (guards)
+    {
+        command = g_slice_new0 (command_t);
+        command->rule = g_hash_table_lookup (rules, "endif");
+        commands = g_slist_append (commands, command);
+        for ( ; guards; guards = g_slist_delete_link (guards, guards))
+        {
+            ((command_t *) guards->data)->endif = g_slist_last (commands);
+        }
+    }
     
     /* show errors if any, exit unless continue-on-error is set */
     if (errors)
@@ -1731,7 +3018,7 @@ main (int argc, char **argv)
          * even with continue-on-error
          * ERROR_RULE_FAILED is pretty much the same, only maybe worse, as it
          * means a command/rule could not be init, and was ignored! */
-        error_out (!continue_on_error || err & (ERROR_RULE_FAILED | ERROR_SYNTAX));
+        error_out (!process.continue_on_error || err & (ERROR_RULE_FAILED | ERROR_SYNTAX));
     }
     
     /* help */
@@ -1752,13 +3039,17 @@ main (int argc, char **argv)
         error (ERROR_SYNTAX, "nothing to do: no rules to be applied\n");
         error_out (TRUE);
     }
+    commands = fuse_commands (commands);
     
     /* create hashmap of actions */
-    actions = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+    actions = g_hash_table_new_full (path_hash, path_equal, NULL,
                                      (GDestroyNotify) free_action);
     
     /* create hashmap of new names */
-    new_names = g_hash_table_new (g_str_hash, g_str_equal);
+    new_names = g_hash_table_new (path_hash, path_equal);
+    
+    /* create hashmap of actions by inode */
+    inodes = g_hash_table_new (inode_hash, inode_equal);
     
     /* get curdir */
     if (!(curdir = getcwd (NULL, 0)))
@@ -1778,11 +3069,82 @@ main (int argc, char **argv)
         init_variables ();
     }
     
+    walk_data.walk = NULL;
+    walk_data.test_types = test_types;
+    walk_data.commands = commands;
+    walk_data.actions_list = &actions_list;
+    if (recursive)
+    {
+        walk.max_depth = max_depth;
+        walk.jobs = (guint) jobs;
+        walk.filter = filter;
+        walk.entry = walk_add_action;
+        walk.error = walk_error;
+        walk.data = &walk_data;
+        walk_data.walk = &walk;
+    }
+    
+    /* files sharing a name get the same new name when all rules are pure */
+    if (!process_fullname && is_pure (commands) && !has_batch_rule (commands))
+    {
+        debug (LEVEL_DEBUG, "caching new names\n");
+        rules_cache = g_slice_new0 (rules_cache_t);
+        rules_cache->names = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    (GDestroyNotify) g_free,
+                                                    (GDestroyNotify) g_free);
+        rules_cache->commands = commands;
+        g_mutex_init (&rules_cache->mutex);
+    }
+    
+    /* rules that can be are applied in threads, while we add actions */
+    if (jobs > 1 && get_sequential_commands (commands) != commands)
+    {
+        debug (LEVEL_DEBUG, "applying rules using %d threads\n", jobs);
+        rules_pool = g_slice_new0 (rules_pool_t);
+        rules_pool->commands = commands;
+        rules_pool->commands_seq = get_sequential_commands (commands);
+        g_queue_init (&rules_pool->jobs);
+        g_mutex_init (&rules_pool->mutex);
+        g_cond_init (&rules_pool->cond);
+        rules_pool->pool = g_thread_pool_new ((GFunc) rules_thread, rules_pool,
+                                              jobs, FALSE, NULL);
+    }
+    
+    /* rules that can be are given names in batches, the other ones after them
+     * being then applied to all names of a batch as well */
+    if (has_batch_rule (commands))
+    {
+        debug (LEVEL_DEBUG, "applying rules on batches of %d files\n",
+               batch_size);
+        rules_batch = g_slice_new0 (rules_batch_t);
+        rules_batch->commands = (rules_pool) ? rules_pool->commands_seq
+                                             : commands;
+        rules_batch->size = (guint) batch_size;
+        rules_batch->actions = g_ptr_array_sized_new ((guint) batch_size);
+        rules_batch->files = g_hash_table_new (path_hash, path_equal);
+        rules_batch->inodes = g_hash_table_new (inode_hash, inode_equal);
+        rules_batch->names = g_new (const gchar *, rules_batch->size);
+        rules_batch->lens = g_new (gsize, rules_batch->size);
+        rules_batch->bufs = g_new0 (molt_buf_t, 2 * rules_batch->size);
+        rules_batch->items = g_new (rule_batch_item_t, rules_batch->size);
+        rules_batch->skips = g_new (GSList *, rules_batch->size);
+    }
+    
+    /* lookups on the files specified are done ahead, while we process the
+     * previous ones */
+    if (queue_depth > 0)
+    {
+        debug (LEVEL_DEBUG, "prefetching up to %d files\n", queue_depth);
+        prefetch = prefetch_new ((guint) queue_depth, prefetch_add_actions,
+                                 &walk_data);
+    }
+    
     if (from_stdin)
     {
-        FILE  *stream;
-        char   buf[4096];
-        size_t len;
+        FILE     *stream;
+        reader_t *reader;
+        gchar    *buf;
+        gsize     len;
         
         debug (LEVEL_DEBUG, "process file names from stdin\n");
         
@@ -1803,34 +3165,80 @@ main (int argc, char **argv)
             error_out (TRUE);
         }
         
-        while (fgets ((char *)&buf, 4096, stream))
+        reader = reader_new (stream, stdin_delim);
+        while ((buf = reader_next (reader, &len, &local_err)))
         {
-            /* reading from stdin, filenames might end with a \n to strip */
-            len = strlen (buf);
-            if (buf[len - 1] == '\n')
-            {
-                --len;
-                buf[len] = '\0';
-            }
             if (len > 0)
             {
-                add_action_for_file (buf, test_types, commands, &actions_list);
+                add_input_file (buf, prefetch, &walk_data);
             }
         }
+        reader_free (reader);
+        if (G_UNLIKELY (local_err))
+        {
+            error (ERROR_FILE, "unable to read stdin: %s\n", local_err->message);
+            g_clear_error (&local_err);
+        }
     }
     else
     {
         debug (LEVEL_DEBUG, "process file names from args, i=%d\n", argi);
         for ( ; argi < argc; ++argi)
         {
-            add_action_for_file (argv[argi], test_types, commands, &actions_list);
+            add_input_file (argv[argi], prefetch, &walk_data);
+        }
+    }
+    if (prefetch)
+    {
+        /* process what's still pending */
+        prefetch_free (prefetch);
+    }
+    if (rules_pool)
+    {
+        /* add actions whose rules are still being applied */
+        add_pooled_actions (TRUE, &actions_list);
+        g_thread_pool_free (rules_pool->pool, FALSE, TRUE);
+        g_mutex_clear (&rules_pool->mutex);
+        g_cond_clear (&rules_pool->cond);
+        g_slice_free (rules_pool_t, rules_pool);
+        rules_pool = NULL;
+    }
+    if (rules_batch)
+    {
+        /* add actions from the last batch */
+        if (rules_batch->actions->len > 0)
+        {
+            add_batched_actions (&actions_list);
+        }
+        for (i = 0; i < 2 * rules_batch->size; ++i)
+        {
+            buffer_free (&rules_batch->bufs[i]);
         }
+        g_ptr_array_free (rules_batch->actions, TRUE);
+        g_hash_table_destroy (rules_batch->files);
+        g_hash_table_destroy (rules_batch->inodes);
+        g_free (rules_batch->names);
+        g_free (rules_batch->lens);
+        g_free (rules_batch->bufs);
+        g_free (rules_batch->items);
+        g_free (rules_batch->skips);
+        g_slice_free (rules_batch_t, rules_batch);
+        rules_batch = NULL;
+    }
+    if (streaming && actions_list)
+    {
+        flush_actions (&actions_list);
+    }
+    if (rules_cache)
+    {
+        g_hash_table_destroy (rules_cache->names);
+        g_mutex_clear (&rules_cache->mutex);
+        g_slice_free (rules_cache_t, rules_cache);
+        rules_cache = NULL;
     }
     free_commands (commands);
     if (do_resolve_variables)
     {
-        /* clear cache of per-file values */
-        g_hash_table_destroy (var_per_file);
         /* clear cache of global values */
         g_hash_table_destroy (var_global);
         /* we're done with variables */
@@ -1846,178 +3254,21 @@ main (int argc, char **argv)
          * its params or something) and the new name couldn't be established,
          * which could also have impact in terms of conflicts and such.
          * So we bail out even with continue-on-error */
-        error_out (!continue_on_error || err & ERROR_RULE_FAILED);
+        error_out (!process.continue_on_error || err & ERROR_RULE_FAILED);
     }
     
-    if (G_UNLIKELY (!actions_list))
+    /* in streaming mode, stream_dir is set once there was an action */
+    if (G_UNLIKELY (!actions_list && !stream_dir))
     {
         /* i.e. nothing was specified on command-line, hence ERROR_SYNTAX */
         error (ERROR_SYNTAX, "nothing to do: no files to rename\n");
         error_out (TRUE);
     }
     
-    gint state;
-    gchar *name;
-    
-#define action_error(...)   do {                        \
-    if (nb_two_steps == 0)                              \
-    {                                                   \
-        fprintf (stderr, __VA_ARGS__);                  \
-    }                                                   \
-    else                                                \
-    {                                                   \
-        action->error = g_strdup_printf (__VA_ARGS__);  \
-    }                                                   \
-} while (0)
-
-#define do_rename(old_name, new_name)   do {                        \
-    if (make_parents)                                               \
-    {                                                               \
-        gchar *s;                                                   \
-        if (NULL != (s = strrchr (new_name, '/')))                  \
-        {                                                           \
-            *s = '\0';                                              \
-            debug (LEVEL_DEBUG, "ensuring %s exists\n", new_name);  \
-            g_mkdir_with_parents (new_name, 0755);                  \
-            *s = '/';                                               \
-        }                                                           \
-    }                                                               \
-    debug (LEVEL_DEBUG, "renaming %s to %s\n", old_name, new_name); \
-    if (G_UNLIKELY (0 != (state = rename (old_name, new_name))))    \
-    {                                                               \
-        err |= ERROR_RENAME_FAILURE;                                \
-        action_error ("%s: failed to rename to %s: %s\n",           \
-                    action->file, new_name, strerror (errno));      \
-    }                                                               \
-} while (0)
-    
-    /* process actions: rename files & construct output */
-    for (l = actions_list; l; l = l->next)
-    {
-        action = l->data;
-        name = NULL;
-        state = -1;
-        
-        if (only_rules)
-        {
-            name = action->new_name;
-            nb_two_steps = 0;
-            state = 0;
-        }
-        else if (action->state & ST_TO_RENAME)
-        {
-            /* only rename if we "can" do the rename, i.e. either there was no
-             * conflicts found, or continue-on-error is set */
-            if (nb_conflicts == 0 || continue_on_error)
-            {
-                if (!dry_run)
-                {
-                    if (action->state & ST_TWO_STEPS)
-                    {
-                        action->tmp_name = get_tmp_name (action->new_name);
-                        name = action->tmp_name;
-                    }
-                    else
-                    {
-                        name = action->new_name;
-                    }
-                    
-                    /* name could be NULL if get_tmp_name() somehow failed */
-                    if (G_LIKELY (name))
-                    {
-                        do_rename (action->file, name);
-                    }
-                    else
-                    {
-                        state = -1;
-                    }
-                    
-                    if (G_UNLIKELY (state != 0))
-                    {
-                        /* do_rename took care of the error message */
-                        if (action->tmp_name)
-                        {
-                            g_free (action->tmp_name);
-                            action->tmp_name = NULL;
-                        }
-                        name = action->file;
-                        /* remove the to-rename state so that in case of a
-                         * second pass (if nb_two_steps > 0) it isn't seen
-                         * as to-rename and therefore marked as success */
-                        action->state &= ~ST_TO_RENAME;
-                    }
-                }
-                else
-                {
-                    name = action->new_name;
-                    state = 0;
-                }
-            }
-        }
-        else if (action->state & ST_CONFLICT)
-        {
-            err |= ERROR_CONFLICT_RENAME;
-            action_error ("%s: cannot be renamed, conflict\n", action->file);
-        }
-        else if (action->state & ST_CONFLICT_FS)
-        {
-            err |= ERROR_CONFLICT_FS;
-            action_error ("%s: cannot be renamed, new name (%s) in use\n",
-                          action->file, action->new_name);
-        }
-        if (!name)
-        {
-            name = action->file;
-        }
-        /* output can be shown if no two-steps renaming are required, else
-         * we prepare it but only show it once everything was processed, in
-         * in order to be accurate and keep the order as expected */
-        if (nb_two_steps == 0)
-        {
-            show_output (output, state, action, name);
-        }
-    }
-    
-    /* if there were two-steps renaming, we need to finish them & show output */
-    if (nb_two_steps > 0)
+    if (!streaming)
     {
-        for (l = actions_list; l; l = l->next)
-        {
-            action = l->data;
-            state = -1;
-            name = action->new_name;
-            
-            if (action->tmp_name)
-            {
-                do_rename (action->tmp_name, name);
-                if (G_UNLIKELY (state != 0))
-                {
-                    /* do_rename took care of the error message */
-                    name = action->tmp_name;
-                }
-            }
-            else if (action->state & ST_TO_RENAME)
-            {
-                state = 0;
-            }
-            
-            if (action->error)
-            {
-                fprintf (stderr, "%s", action->error);
-                g_free (action->error);
-                action->error = NULL;
-            }
-            show_output (output, state, action, name);
-            
-            if (action->tmp_name)
-            {
-                g_free (action->tmp_name);
-                action->tmp_name = NULL;
-            }
-        }
+        process_actions (actions_list, &process);
     }
-#undef do_rename
-#undef action_error
     
     if (err)
     {
@@ -30,10 +30,32 @@ extern "C" {
 #define APP_VERSION                 "0.0.1"
 #define PLUGINS_PATH                "/usr/lib/molt/"
 
+/* max number of actions sent to the pool of threads applying rules, before
+ * waiting for the oldest one */
+#define MAX_RULES_JOBS              1024
+
+/* default max number of actions in a batch, for rules running on batches */
+#define DEFAULT_BATCH_SIZE          1000
+
+/* max number of names whose new name is cached, when all rules are pure. Once
+ * reached, the cache is emptied */
+#define MAX_RULES_CACHE             4096
+
 #define OPT_EXCLUDE_DIRS            'D'
 #define OPT_EXCLUDE_FILES           'F'
 #define OPT_EXCLUDE_SYMLINKS        'S'
 #define OPT_FROM_STDIN              'i'
+#define OPT_RECURSIVE               'r'
+#define OPT_MAX_DEPTH               'L'
+#define OPT_NULL                    '0'
+#define OPT_INCLUDE                 'I'
+#define OPT_EXCLUDE                 'X'
+#define OPT_INCLUDE_REGEX           'e'
+#define OPT_EXCLUDE_REGEX           'E'
+#define OPT_JOBS                    'j'
+#define OPT_QUEUE_DEPTH             'Q'
+#define OPT_STREAM                  's'
+#define OPT_BATCH_SIZE              'b'
 
 #define OPT_PROCESS_FULLNAME        'P'
 #define OPT_ALLOW_PATH              'p'
@@ -54,6 +76,7 @@ extern "C" {
 typedef struct {
 	gchar        opt_short;
 	const gchar *opt_long;
+    const gchar *arg;
     const gchar *help;
 } option_t;
 
@@ -61,8 +84,54 @@ typedef struct {
 typedef struct {
     rule_def_t *rule;
     gpointer    data;
+    GSList     *endif;      /* guards: link of the matching endif */
 } command_t;
 
+/* what's needed to add actions for files found walking directories (or
+ * prefetched) */
+typedef struct {
+    walk_t     *walk;           /* NULL unless recursive */
+    GFileTest   test_types;
+    GSList     *commands;
+    GSList    **actions_list;
+} walk_data_t;
+
+/* with --jobs, rules that can be are applied on a pool of threads */
+typedef struct {
+    GThreadPool *pool;
+    GSList      *commands;      /* commands applied in threads */
+    GSList      *commands_seq;  /* first command to apply on the main thread */
+    GQueue       jobs;          /* pending rules_job_t, in input order */
+    GMutex       mutex;
+    GCond        cond;
+} rules_pool_t;
+
+/* when all rules are pure, new names they gave, per name */
+typedef struct {
+    GHashTable  *names;
+    GSList      *commands;      /* commands the cache is for */
+    GMutex       mutex;
+} rules_cache_t;
+
+typedef struct {
+    action_t    *action;
+    gboolean     done;          /* whether rules (in threads) were applied */
+} rules_job_t;
+
+/* with rules running on batches, actions are added once there's enough */
+typedef struct {
+    GSList            *commands;    /* commands applied on batches */
+    guint              size;        /* max number of actions */
+    GPtrArray         *actions;
+    GHashTable        *files;       /* actions in the batch, by file */
+    GHashTable        *inodes;      /* and by inode */
+    const gchar      **names;       /* current name of each action */
+    gsize             *lens;
+    molt_buf_t        *bufs;        /* two per action */
+    GSList           **skips;       /* per action, endif it skips rules to */
+    rule_batch_item_t *items;
+} rules_batch_t;
+
 /* different type of output */
 typedef enum {
 	OUTPUT_STANDARD = 0,	/* regular stuff */
@@ -70,6 +139,15 @@ typedef enum {
 	OUTPUT_NEW_NAMES,		/* list of (new) names */
 } output_t;
 
+/* how actions are processed, i.e. renamed & shown */
+typedef struct {
+    output_t    output;
+    gboolean    only_rules;
+    gboolean    dry_run;
+    gboolean    continue_on_error;
+    gboolean    make_parents;
+} process_t;
+
 struct _plugin_priv_t {
     gchar   *file;
     GModule *module;
@@ -31,7 +31,7 @@ extern "C" {
 #include <glib-2.0/glib.h>
 
 /* Current API version: incremented when on any plugin API changes */
-#define MOLT_API_VERSION   1
+#define MOLT_API_VERSION   4
 /* Current ABI version: incremented on binary interface changes, i.e. plugin
  * data types change and plugin needs to be recompiled with new header.
  * Adding data to struct will not increment it, since it wouldn't cause
@@ -55,9 +55,57 @@ typedef gboolean (*rule_run_fn) (gpointer    *data,
                                  gchar      **new_name,
                                  GError     **error);
 
+/* buffer owned by molt, a rule (since API 3) writes its new name into. It
+ * is reused from one rule/file to the next, so it must only be grown through
+ * molt_buf_reserve/molt_buf_append. str is NULL until anything was added */
+typedef struct {
+    gchar   *str;
+    gsize    len;
+    gsize    alloc;
+} molt_buf_t;
+
+typedef enum {
+    RULE_RESULT_ERROR = 0,  /* error must be set */
+    RULE_RESULT_UNCHANGED,  /* the name stays as is, out isn't used */
+    RULE_RESULT_CHANGED     /* out (empty on call) holds the new name */
+} rule_result_t;
+
+/* function called by molt to run a rule, since API 3. name is len bytes long
+ * (and NUL-terminated), the new name must be written in out */
+typedef rule_result_t (*rule_run_buf_fn) (gpointer    *data,
+                                          const gchar *name,
+                                          gsize        len,
+                                          molt_buf_t  *out,
+                                          GError     **error);
+
+/* a name in a batch given to a rule, since API 4 */
+typedef struct {
+    const gchar    *name;
+    gsize           len;
+    molt_buf_t     *out;        /* as for run_buf */
+    rule_result_t   result;     /* RULE_RESULT_UNCHANGED on call */
+    GError         *error;      /* to set on RULE_RESULT_ERROR */
+} rule_batch_item_t;
+
+/* function called by molt to run a rule on nb names at once (in input order),
+ * since API 4. Returning FALSE (with error set) fails them all */
+typedef gboolean (*rule_run_batch_fn) (gpointer          *data,
+                                       rule_batch_item_t *items,
+                                       guint              nb,
+                                       GError           **error);
+
 /* function called by molt to destroy/free a rule (command really) */
 typedef void (*rule_destroy_fn) (gpointer *data);
 
+typedef enum {
+    /* run can be called from different threads at once (on different names),
+     * i.e. it doesn't change data nor has any state (e.g. a counter) */
+    RULE_FLAG_THREAD_SAFE   = (1 << 0),
+    /* the new name only depends on the name (and the rule's parameters), not
+     * on the file nor any state, so it can be cached for files sharing one */
+    RULE_FLAG_PURE          = (1 << 1)
+} rule_flags_t;
+
 /* definition of a rule */
 typedef struct {
     const gchar    *name;
@@ -68,6 +116,13 @@ typedef struct {
     rule_run_fn     run;
     rule_destroy_fn destroy;
     gboolean        resolve_variables;
+    /* since API 2 */
+    rule_flags_t    flags;
+    /* since API 3: if set, used instead of run */
+    rule_run_buf_fn run_buf;
+    /* since API 4: if set, used instead, always from the main thread, on
+     * batches of names (see --batch-size) */
+    rule_run_batch_fn run_batch;
 } rule_def_t;
 
 typedef enum {
@@ -109,6 +164,9 @@ typedef struct {
     gboolean (*add_rule)      (rule_def_t *rule);
     gboolean (*add_var)       (var_def_t *variable);
     gboolean (*add_var_value) (const gchar *name, gchar *params, gchar *value);
+    /* since API 3 */
+    gchar *  (*buf_reserve)   (molt_buf_t *buf, gsize len);
+    void     (*buf_append)    (molt_buf_t *buf, const gchar *str, gsize len);
 } plugin_functions_t;
 
 /* private structure for molt */
@@ -167,6 +225,10 @@ typedef void (*destroy_fn) (void);
     molt_plugin->functions->add_var (variable)
 #define molt_add_var_value(name, params, value) \
     molt_plugin->functions->add_var_value (name, params, value)
+#define molt_buf_reserve(buf, len)  \
+    molt_plugin->functions->buf_reserve (buf, len)
+#define molt_buf_append(buf, str, len)  \
+    molt_plugin->functions->buf_append (buf, str, len)
 
 #endif  /* IS_MOLT */
 
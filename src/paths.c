@@ -0,0 +1,404 @@
+/**
+ * molt - Copyright (C) 2012 Olivier Brunel
+ *
+ * paths.c
+ * Copyright (C) 2012 Olivier Brunel <i.am.jack.mail@gmail.com>
+ *
+ * This file is part of molt.
+ *
+ * molt is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * molt is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * molt. If not, see http://www.gnu.org/licenses/
+ */
+
+#define _GNU_SOURCE     /* for O_PATH & *at() */
+
+/* C */
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+
+/* molt */
+#include "paths.h"
+
+#ifndef O_PATH
+#define O_PATH              O_RDONLY
+#endif
+
+/* max number of directories kept open at once */
+#define MAX_OPEN_DIRS       256
+
+static dir_t *root   = NULL;
+static guint  last_id = 0;
+/* last directory looked up by path, since files usually come from the same
+ * directory as the previous one */
+static dir_t *last   = NULL;
+/* directories with an open fd */
+static GPtrArray *open_dirs = NULL;
+
+static dir_t *
+dir_new (dir_t *parent, const gchar *name)
+{
+    dir_t *dir;
+    
+    dir = g_slice_new0 (dir_t);
+    dir->parent = parent;
+    dir->id = ++last_id;
+    dir->fd = -1;
+    if (parent)
+    {
+        dir->path = g_strconcat (parent->path, "/", name, NULL);
+        dir->len = parent->len + 1 + strlen (name);
+    }
+    else
+    {
+        dir->path = g_strdup ("");
+    }
+    return dir;
+}
+
+static void
+dir_free (dir_t *dir)
+{
+    if (dir->fd >= 0)
+    {
+        close (dir->fd);
+    }
+    if (dir->children)
+    {
+        g_hash_table_destroy (dir->children);
+    }
+    g_free (dir->path);
+    g_slice_free (dir_t, dir);
+}
+
+dir_t *
+dir_get_root (void)
+{
+    if (!root)
+    {
+        root = dir_new (NULL, NULL);
+    }
+    return root;
+}
+
+dir_t *
+dir_get_child (dir_t *dir, const gchar *name)
+{
+    dir_t *child = NULL;
+    
+    if (!dir->children)
+    {
+        /* keys are the child's name, pointing inside its path */
+        dir->children = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                               (GDestroyNotify) dir_free);
+    }
+    else
+    {
+        child = g_hash_table_lookup (dir->children, name);
+    }
+    
+    if (!child)
+    {
+        child = dir_new (dir, name);
+        g_hash_table_insert (dir->children, child->path + dir->len + 1, child);
+    }
+    return child;
+}
+
+/* returns the directory for the first len chars of path, which must be an
+ * absolute & normalized (no ./ or ../) path, without trailing slash */
+dir_t *
+dir_get (const gchar *path, gsize len)
+{
+    dir_t       *dir;
+    const gchar *s;
+    const gchar *e;
+    gchar       *name;
+    
+    if (last && last->len == len && strncmp (last->path, path, len) == 0)
+    {
+        return last;
+    }
+    
+    dir = dir_get_root ();
+    /* start from the deepest parent of last that's a prefix of path */
+    if (last)
+    {
+        for (dir = last; dir->parent; dir = dir->parent)
+        {
+            if ((dir->len == len || (dir->len < len && path[dir->len] == '/'))
+                    && strncmp (dir->path, path, dir->len) == 0)
+            {
+                break;
+            }
+        }
+    }
+    
+    for (s = path + dir->len; s < path + len; s = e)
+    {
+        /* skip the slash */
+        ++s;
+        e = memchr (s, '/', (gsize) (path + len - s));
+        if (!e)
+        {
+            e = path + len;
+        }
+        name = g_strndup (s, (gsize) (e - s));
+        dir = dir_get_child (dir, name);
+        g_free (name);
+    }
+    
+    last = dir;
+    return dir;
+}
+
+/* returns a newly allocated string with the full path/name */
+gchar *
+path_get_full (const path_t *path)
+{
+    gchar *s;
+    gsize  len;
+    
+    len = strlen (path->name);
+    s = g_malloc (path->dir->len + len + 2);
+    memcpy (s, path->dir->path, path->dir->len);
+    s[path->dir->len] = '/';
+    memcpy (s + path->dir->len + 1, path->name, len + 1);
+    return s;
+}
+
+/* sets path from fullname, which must be an absolute & normalized path.
+ * Returns FALSE if there's no filename (i.e. it ends with a slash) */
+gboolean
+path_set (path_t *path, const gchar *fullname)
+{
+    const gchar *s;
+    
+    s = strrchr (fullname, '/');
+    path->dir = dir_get (fullname, (gsize) (s - fullname));
+    path->name = g_strdup (s + 1);
+    return *path->name != '\0';
+}
+
+/* whether path is the one given as fullname */
+gboolean
+path_is (const path_t *path, const gchar *fullname)
+{
+    return strncmp (fullname, path->dir->path, path->dir->len) == 0
+        && fullname[path->dir->len] == '/'
+        && strcmp (fullname + path->dir->len + 1, path->name) == 0;
+}
+
+guint
+path_hash (gconstpointer key)
+{
+    const path_t *path = key;
+    
+    return path->dir->id * 31 + g_str_hash (path->name);
+}
+
+gboolean
+path_equal (gconstpointer a, gconstpointer b)
+{
+    const path_t *p1 = a;
+    const path_t *p2 = b;
+    
+    return p1->dir == p2->dir && strcmp (p1->name, p2->name) == 0;
+}
+
+/* returns an fd (O_PATH) for dir, opened if needed, or -1 if it couldn't be
+ * opened (in which case full paths must be used) */
+gint
+dir_get_fd (dir_t *dir)
+{
+    guint i;
+    
+    if (dir->fd >= 0)
+    {
+        return dir->fd;
+    }
+    
+    if (!open_dirs)
+    {
+        open_dirs = g_ptr_array_new ();
+    }
+    else if (open_dirs->len >= MAX_OPEN_DIRS)
+    {
+        /* files usually come one directory after the other, so there's little
+         * point in doing better than closing them all */
+        for (i = 0; i < open_dirs->len; ++i)
+        {
+            dir_t *d = g_ptr_array_index (open_dirs, i);
+            close (d->fd);
+            d->fd = -1;
+        }
+        g_ptr_array_set_size (open_dirs, 0);
+    }
+    
+    dir->fd = open ((dir->len > 0) ? dir->path : "/",
+                    O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (dir->fd >= 0)
+    {
+        g_ptr_array_add (open_dirs, dir);
+    }
+    return dir->fd;
+}
+
+/* closes the fd of dir & all its subdirectories, e.g. because it was renamed
+ * and the fds would now point to a different path */
+static void
+dir_close (dir_t *dir)
+{
+    GHashTableIter iter;
+    gpointer       child;
+    
+    if (dir->fd >= 0)
+    {
+        close (dir->fd);
+        dir->fd = -1;
+        g_ptr_array_remove_fast (open_dirs, dir);
+    }
+    
+    if (dir->children)
+    {
+        g_hash_table_iter_init (&iter, dir->children);
+        while (g_hash_table_iter_next (&iter, NULL, &child))
+        {
+            dir_close (child);
+        }
+    }
+}
+
+/* lstat() on path, relative to its directory's fd when possible */
+gint
+path_lstat (const path_t *path, struct stat *st)
+{
+    gchar *file;
+    gint   fd;
+    gint   ret;
+    
+    fd = dir_get_fd (path->dir);
+    if (G_LIKELY (fd >= 0))
+    {
+        return fstatat (fd, path->name, st, AT_SYMLINK_NOFOLLOW);
+    }
+    
+    file = path_get_full (path);
+    ret = lstat (file, st);
+    g_free (file);
+    return ret;
+}
+
+/* renames old_path to new_path, relative to their directories' fds when
+ * possible. Returns 0 on success, else -1 with errno set */
+gint
+path_rename (const path_t *old_path, const path_t *new_path)
+{
+    dir_t *dir;
+    gchar *old_name;
+    gchar *new_name;
+    gint   fd_old;
+    gint   fd_new;
+    gint   ret;
+    
+    fd_old = dir_get_fd (old_path->dir);
+    fd_new = dir_get_fd (new_path->dir);
+    /* in case opening new_path's dir closed all fds */
+    if (fd_old >= 0 && old_path->dir->fd < 0)
+    {
+        fd_old = dir_get_fd (old_path->dir);
+    }
+    
+    if (G_LIKELY (fd_old >= 0 && fd_new >= 0))
+    {
+        ret = renameat (fd_old, old_path->name, fd_new, new_path->name);
+    }
+    else
+    {
+        old_name = path_get_full (old_path);
+        new_name = path_get_full (new_path);
+        ret = rename (old_name, new_name);
+        g_free (old_name);
+        g_free (new_name);
+    }
+    
+    if (ret == 0 && open_dirs && open_dirs->len > 0)
+    {
+        /* if we renamed a directory, fds opened within it are now wrong */
+        if (old_path->dir->children && (dir = g_hash_table_lookup (
+                        old_path->dir->children, old_path->name)))
+        {
+            dir_close (dir);
+        }
+        if (new_path->dir->children && (dir = g_hash_table_lookup (
+                        new_path->dir->children, new_path->name)))
+        {
+            dir_close (dir);
+        }
+    }
+    return ret;
+}
+
+/* makes sure dir exists, creating it (and its parents) if needed. Returns 0 on
+ * success, else -1 with errno set */
+gint
+dir_make (dir_t *dir, mode_t mode)
+{
+    gint fd;
+    gint ret;
+    
+    /* the root always exists */
+    if (!dir->parent || dir_get_fd (dir) >= 0)
+    {
+        return 0;
+    }
+    
+    if (dir_make (dir->parent, mode) < 0)
+    {
+        return -1;
+    }
+    
+    fd = dir_get_fd (dir->parent);
+    if (G_LIKELY (fd >= 0))
+    {
+        ret = mkdirat (fd, dir->path + dir->parent->len + 1, mode);
+    }
+    else
+    {
+        ret = mkdir (dir->path, mode);
+    }
+    
+    if (ret < 0 && errno != EEXIST)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+void
+dirs_free (void)
+{
+    if (root)
+    {
+        dir_free (root);
+        root = NULL;
+        last = NULL;
+    }
+    if (open_dirs)
+    {
+        g_ptr_array_free (open_dirs, TRUE);
+        open_dirs = NULL;
+    }
+}
@@ -0,0 +1,103 @@
+/**
+ * molt - Copyright (C) 2012 Olivier Brunel
+ *
+ * paths.h
+ * Copyright (C) 2012 Olivier Brunel <i.am.jack.mail@gmail.com>
+ *
+ * This file is part of molt.
+ *
+ * molt is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * molt is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * molt. If not, see http://www.gnu.org/licenses/
+ */
+
+
+#ifndef PATHS_H
+#define	PATHS_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/* C */
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* glib */
+#include <glib-2.0/glib.h>
+
+/* a directory: each one is only created once (interned), as a node in a tree
+ * starting from the root directory */
+typedef struct _dir_t dir_t;
+struct _dir_t {
+    dir_t       *parent;
+    gchar       *path;      /* full path ("" for the root), stored once per
+                             * directory so it never needs to be rebuilt */
+    gsize        len;       /* length of path */
+    guint        id;
+    gint         fd;        /* O_PATH fd, opened when needed, or -1 */
+    GHashTable  *children;  /* name -> dir_t, created when needed */
+};
+
+/* a file, as its directory & name */
+typedef struct {
+    dir_t       *dir;
+    gchar       *name;
+} path_t;
+
+/* to print a path using "%s/%s" (the root's path being empty) */
+#define PATH_ARGS(p)        (p)->dir->path, (p)->name
+
+dir_t *
+dir_get_root (void);
+
+dir_t *
+dir_get_child (dir_t *dir, const gchar *name);
+
+dir_t *
+dir_get (const gchar *path, gsize len);
+
+gint
+dir_get_fd (dir_t *dir);
+
+gint
+dir_make (dir_t *dir, mode_t mode);
+
+gchar *
+path_get_full (const path_t *path);
+
+gboolean
+path_set (path_t *path, const gchar *fullname);
+
+gint
+path_lstat (const path_t *path, struct stat *st);
+
+gint
+path_rename (const path_t *old_path, const path_t *new_path);
+
+gboolean
+path_is (const path_t *path, const gchar *fullname);
+
+guint
+path_hash (gconstpointer key);
+
+gboolean
+path_equal (gconstpointer a, gconstpointer b);
+
+void
+dirs_free (void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* PATHS_H */
@@ -0,0 +1,486 @@
+/**
+ * molt - Copyright (C) 2012 Olivier Brunel
+ *
+ * prefetch.c
+ * Copyright (C) 2012 Olivier Brunel <i.am.jack.mail@gmail.com>
+ *
+ * This file is part of molt.
+ *
+ * molt is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * molt is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * molt. If not, see http://www.gnu.org/licenses/
+ */
+
+
+#define _GNU_SOURCE     /* for syscall() & struct statx */
+
+/* C */
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+
+/* molt */
+#include "prefetch.h"
+
+/* how many new requests we let pile up before submitting them to the ring */
+#define SUBMIT_BATCH        16
+/* max number of threads when io_uring isn't available */
+#define MAX_THREADS         64
+
+/* all that lstat() gives, so the struct stat made from it is the same */
+#define STATX_MASK          STATX_BASIC_STATS
+
+typedef struct {
+    gchar        *file;
+    struct statx  stx;      /* filled by io_uring */
+    struct stat   st;       /* filled by threads */
+    gint          res;      /* 0 or -errno */
+    gboolean      done;
+} slot_t;
+
+struct _prefetch_t {
+    prefetch_fn      fn;
+    gpointer         data;
+    /* requests in flight, in order: head is the oldest one */
+    slot_t          *slots;
+    guint            depth;
+    guint            head;
+    guint            count;
+    
+    /* io_uring; ring_fd is -1 when not used */
+    gint             ring_fd;
+    guint            to_submit;
+    guint            in_flight; /* submitted, not yet completed */
+    gpointer         sq_ptr;
+    gsize            sq_size;
+    gpointer         cq_ptr;
+    gsize            cq_size;
+    struct io_uring_sqe *sqes;
+    gsize            sqes_size;
+    guint           *sq_tail;
+    guint           *sq_mask;
+    guint           *sq_array;
+    guint           *cq_head;
+    guint           *cq_tail;
+    guint           *cq_mask;
+    struct io_uring_cqe *cqes;
+    
+    /* thread pool fallback */
+    GThreadPool     *pool;
+    GMutex           mutex;
+    GCond            cond;
+};
+
+static void
+thread_stat (gpointer data, gpointer user_data)
+{
+    prefetch_t *prefetch = user_data;
+    slot_t *slot = data;
+    gint res;
+    
+    res = (lstat (slot->file, &slot->st) == 0) ? 0 : -errno;
+    
+    g_mutex_lock (&prefetch->mutex);
+    slot->res = res;
+    slot->done = TRUE;
+    g_cond_broadcast (&prefetch->cond);
+    g_mutex_unlock (&prefetch->mutex);
+}
+
+static void
+pool_init (prefetch_t *prefetch)
+{
+    g_mutex_init (&prefetch->mutex);
+    g_cond_init (&prefetch->cond);
+    prefetch->pool = g_thread_pool_new (thread_stat, prefetch,
+                                        (gint) MIN (prefetch->depth, MAX_THREADS),
+                                        FALSE, NULL);
+}
+
+#ifdef __NR_io_uring_setup
+static gboolean
+ring_supports_statx (gint fd)
+{
+    struct io_uring_probe *probe;
+    gsize size;
+    gboolean supported = FALSE;
+    
+    size = sizeof (*probe) + 256 * sizeof (struct io_uring_probe_op);
+    probe = g_malloc0 (size);
+    if (syscall (__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0)
+    {
+        supported = probe->last_op >= IORING_OP_STATX
+            && probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED;
+    }
+    g_free (probe);
+    return supported;
+}
+
+static gboolean
+ring_init (prefetch_t *prefetch)
+{
+    struct io_uring_params p;
+    gchar *sq;
+    gchar *cq;
+    gint fd;
+    
+    memset (&p, 0, sizeof (p));
+    fd = (gint) syscall (__NR_io_uring_setup, prefetch->depth, &p);
+    if (fd < 0)
+    {
+        return FALSE;
+    }
+    if (!ring_supports_statx (fd))
+    {
+        close (fd);
+        return FALSE;
+    }
+    
+    prefetch->sq_size = p.sq_off.array + p.sq_entries * sizeof (guint);
+    prefetch->cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        prefetch->sq_size = prefetch->cq_size = MAX (prefetch->sq_size,
+                                                     prefetch->cq_size);
+    }
+    prefetch->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+    
+    prefetch->sq_ptr = mmap (NULL, prefetch->sq_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (prefetch->sq_ptr == MAP_FAILED)
+    {
+        close (fd);
+        return FALSE;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        prefetch->cq_ptr = prefetch->sq_ptr;
+    }
+    else
+    {
+        prefetch->cq_ptr = mmap (NULL, prefetch->cq_size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (prefetch->cq_ptr == MAP_FAILED)
+        {
+            munmap (prefetch->sq_ptr, prefetch->sq_size);
+            close (fd);
+            return FALSE;
+        }
+    }
+    prefetch->sqes = mmap (NULL, prefetch->sqes_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (prefetch->sqes == MAP_FAILED)
+    {
+        if (prefetch->cq_ptr != prefetch->sq_ptr)
+        {
+            munmap (prefetch->cq_ptr, prefetch->cq_size);
+        }
+        munmap (prefetch->sq_ptr, prefetch->sq_size);
+        close (fd);
+        return FALSE;
+    }
+    
+    sq = prefetch->sq_ptr;
+    prefetch->sq_tail  = (guint *) (gpointer) (sq + p.sq_off.tail);
+    prefetch->sq_mask  = (guint *) (gpointer) (sq + p.sq_off.ring_mask);
+    prefetch->sq_array = (guint *) (gpointer) (sq + p.sq_off.array);
+    cq = prefetch->cq_ptr;
+    prefetch->cq_head  = (guint *) (gpointer) (cq + p.cq_off.head);
+    prefetch->cq_tail  = (guint *) (gpointer) (cq + p.cq_off.tail);
+    prefetch->cq_mask  = (guint *) (gpointer) (cq + p.cq_off.ring_mask);
+    prefetch->cqes     = (struct io_uring_cqe *) (gpointer) (cq + p.cq_off.cqes);
+    
+    prefetch->ring_fd = fd;
+    return TRUE;
+}
+
+static void
+ring_free (prefetch_t *prefetch)
+{
+    munmap (prefetch->sqes, prefetch->sqes_size);
+    if (prefetch->cq_ptr != prefetch->sq_ptr)
+    {
+        munmap (prefetch->cq_ptr, prefetch->cq_size);
+    }
+    munmap (prefetch->sq_ptr, prefetch->sq_size);
+    close (prefetch->ring_fd);
+}
+
+static void
+ring_queue (prefetch_t *prefetch, guint i)
+{
+    struct io_uring_sqe *sqe;
+    guint tail;
+    guint idx;
+    glong submitted;
+    
+    tail = *prefetch->sq_tail;
+    idx = tail & *prefetch->sq_mask;
+    sqe = &prefetch->sqes[idx];
+    memset (sqe, 0, sizeof (*sqe));
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (guint64) (guintptr) prefetch->slots[i].file;
+    sqe->len = STATX_MASK;
+    sqe->off = (guint64) (guintptr) &prefetch->slots[i].stx;
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+    sqe->user_data = i;
+    prefetch->sq_array[idx] = idx;
+    __atomic_store_n (prefetch->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    
+    if (++prefetch->to_submit >= SUBMIT_BATCH)
+    {
+        /* the kernel might not take them all, the rest are for next time */
+        submitted = syscall (__NR_io_uring_enter, prefetch->ring_fd,
+                             prefetch->to_submit, 0, 0, NULL, 0);
+        if (submitted > 0)
+        {
+            prefetch->to_submit -= (guint) submitted;
+            prefetch->in_flight += (guint) submitted;
+        }
+    }
+}
+
+/* marks the slots of all completed requests as done */
+static void
+ring_reap (prefetch_t *prefetch)
+{
+    struct io_uring_cqe *cqe;
+    guint head;
+    
+    head = *prefetch->cq_head;
+    while (head != __atomic_load_n (prefetch->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        cqe = &prefetch->cqes[head & *prefetch->cq_mask];
+        prefetch->slots[cqe->user_data].res = cqe->res;
+        prefetch->slots[cqe->user_data].done = TRUE;
+        --prefetch->in_flight;
+        ++head;
+    }
+    __atomic_store_n (prefetch->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* the ring failed: closes it, and hands all pending lookups to threads. Those
+ * that were already done are simply done again */
+static void
+ring_give_up (prefetch_t *prefetch)
+{
+    slot_t *slots;
+    slot_t *slot;
+    guint i;
+    
+    /* the kernel could still read the names of requests in flight, and write
+     * into their slots, so we wait for them all to complete */
+    while (prefetch->in_flight > 0)
+    {
+        if (syscall (__NR_io_uring_enter, prefetch->ring_fd, 0,
+                    prefetch->in_flight, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+                && errno != EINTR)
+        {
+            break;
+        }
+        ring_reap (prefetch);
+    }
+    /* if we can't, slots & names are left to them (i.e. leaked), threads using
+     * copies instead */
+    if (prefetch->in_flight > 0)
+    {
+        slots = g_new0 (slot_t, prefetch->depth);
+        for (i = 0; i < prefetch->count; ++i)
+        {
+            slots[i].file = g_strdup (
+                    prefetch->slots[(prefetch->head + i) % prefetch->depth].file);
+        }
+        prefetch->slots = slots;
+        prefetch->head = 0;
+    }
+    
+    ring_free (prefetch);
+    prefetch->ring_fd = -1;
+    pool_init (prefetch);
+    
+    for (i = 0; i < prefetch->count; ++i)
+    {
+        slot = &prefetch->slots[(prefetch->head + i) % prefetch->depth];
+        slot->res = 0;
+        slot->done = FALSE;
+        g_thread_pool_push (prefetch->pool, slot, NULL);
+    }
+}
+
+/* waits for slot to be done. Returns FALSE if the ring failed & was given up
+ * on, the lookups then being done by threads */
+static gboolean
+ring_wait (prefetch_t *prefetch, slot_t *slot)
+{
+    glong submitted;
+    
+    while (!slot->done)
+    {
+        submitted = syscall (__NR_io_uring_enter, prefetch->ring_fd,
+                             prefetch->to_submit, 1, IORING_ENTER_GETEVENTS,
+                             NULL, 0);
+        if (submitted < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ring_give_up (prefetch);
+            return FALSE;
+        }
+        prefetch->to_submit -= (guint) submitted;
+        prefetch->in_flight += (guint) submitted;
+        ring_reap (prefetch);
+    }
+    return TRUE;
+}
+#endif  /* __NR_io_uring_setup */
+
+/* sends the oldest request (once completed) to the callback */
+static void
+process_head (prefetch_t *prefetch)
+{
+    slot_t *slot = &prefetch->slots[prefetch->head];
+    struct stat st;
+    
+#ifdef __NR_io_uring_setup
+    if (prefetch->ring_fd >= 0 && ring_wait (prefetch, slot))
+    {
+        if (slot->res == 0)
+        {
+            memset (&st, 0, sizeof (st));
+            st.st_mode  = slot->stx.stx_mode;
+            st.st_dev   = makedev (slot->stx.stx_dev_major, slot->stx.stx_dev_minor);
+            st.st_rdev  = makedev (slot->stx.stx_rdev_major, slot->stx.stx_rdev_minor);
+            st.st_ino   = (ino_t) slot->stx.stx_ino;
+            st.st_nlink = (nlink_t) slot->stx.stx_nlink;
+            st.st_uid   = (uid_t) slot->stx.stx_uid;
+            st.st_gid   = (gid_t) slot->stx.stx_gid;
+            st.st_size  = (off_t) slot->stx.stx_size;
+            st.st_blksize = (blksize_t) slot->stx.stx_blksize;
+            st.st_blocks  = (blkcnt_t) slot->stx.stx_blocks;
+            st.st_atim.tv_sec  = (time_t) slot->stx.stx_atime.tv_sec;
+            st.st_atim.tv_nsec = (long) slot->stx.stx_atime.tv_nsec;
+            st.st_mtim.tv_sec  = (time_t) slot->stx.stx_mtime.tv_sec;
+            st.st_mtim.tv_nsec = (long) slot->stx.stx_mtime.tv_nsec;
+            st.st_ctim.tv_sec  = (time_t) slot->stx.stx_ctime.tv_sec;
+            st.st_ctim.tv_nsec = (long) slot->stx.stx_ctime.tv_nsec;
+        }
+    }
+    else
+#endif
+    {
+        /* the ring might have been given up on, with new slots */
+        slot = &prefetch->slots[prefetch->head];
+        g_mutex_lock (&prefetch->mutex);
+        while (!slot->done)
+        {
+            g_cond_wait (&prefetch->cond, &prefetch->mutex);
+        }
+        g_mutex_unlock (&prefetch->mutex);
+        st = slot->st;
+    }
+    
+    prefetch->fn (slot->file, (slot->res == 0) ? &st : NULL, prefetch->data);
+    
+    g_free (slot->file);
+    slot->file = NULL;
+    prefetch->head = (prefetch->head + 1) % prefetch->depth;
+    --prefetch->count;
+}
+
+/* creates a prefetcher keeping up to depth lookups in flight, using io_uring
+ * when available, else a pool of threads */
+prefetch_t *
+prefetch_new (guint depth, prefetch_fn fn, gpointer data)
+{
+    prefetch_t *prefetch;
+    
+    prefetch = g_new0 (prefetch_t, 1);
+    prefetch->fn = fn;
+    prefetch->data = data;
+    prefetch->depth = MAX (depth, 1);
+    prefetch->slots = g_new0 (slot_t, prefetch->depth);
+    prefetch->ring_fd = -1;
+    
+#ifdef __NR_io_uring_setup
+    if (ring_init (prefetch))
+    {
+        return prefetch;
+    }
+#endif
+    
+    pool_init (prefetch);
+    return prefetch;
+}
+
+/* queues a lookup for file. Once it (and all the ones before) are done, the
+ * callback will be called for it */
+void
+prefetch_add (prefetch_t *prefetch, const gchar *file)
+{
+    slot_t *slot;
+    guint i;
+    
+    if (prefetch->count == prefetch->depth)
+    {
+        process_head (prefetch);
+    }
+    
+    i = (prefetch->head + prefetch->count) % prefetch->depth;
+    slot = &prefetch->slots[i];
+    slot->file = g_strdup (file);
+    slot->res = 0;
+    slot->done = FALSE;
+    ++prefetch->count;
+    
+#ifdef __NR_io_uring_setup
+    if (prefetch->ring_fd >= 0)
+    {
+        ring_queue (prefetch, i);
+        return;
+    }
+#endif
+    g_thread_pool_push (prefetch->pool, slot, NULL);
+}
+
+/* processes all pending lookups, then frees the prefetcher */
+void
+prefetch_free (prefetch_t *prefetch)
+{
+    while (prefetch->count > 0)
+    {
+        process_head (prefetch);
+    }
+    
+#ifdef __NR_io_uring_setup
+    if (prefetch->ring_fd >= 0)
+    {
+        ring_free (prefetch);
+    }
+    else
+#endif
+    {
+        g_thread_pool_free (prefetch->pool, FALSE, TRUE);
+        g_mutex_clear (&prefetch->mutex);
+        g_cond_clear (&prefetch->cond);
+    }
+    g_free (prefetch->slots);
+    g_free (prefetch);
+}
@@ -0,0 +1,56 @@
+/**
+ * molt - Copyright (C) 2012 Olivier Brunel
+ *
+ * prefetch.h
+ * Copyright (C) 2012 Olivier Brunel <i.am.jack.mail@gmail.com>
+ *
+ * This file is part of molt.
+ *
+ * molt is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * molt is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * molt. If not, see http://www.gnu.org/licenses/
+ */
+
+
+#ifndef PREFETCH_H
+#define	PREFETCH_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+    
+/* C */
+#include <sys/stat.h>
+    
+/* glib */
+#include <glib-2.0/glib.h>
+    
+/* function called for each file added, in the same order. st is the result
+ * of lstat() on file, or NULL if it failed */
+typedef void (*prefetch_fn) (gchar *file, struct stat *st, gpointer data);
+    
+typedef struct _prefetch_t prefetch_t;
+    
+prefetch_t *
+prefetch_new (guint depth, prefetch_fn fn, gpointer data);
+    
+void
+prefetch_add (prefetch_t *prefetch, const gchar *file);
+    
+void
+prefetch_free (prefetch_t *prefetch);
+    
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* PREFETCH_H */
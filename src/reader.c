@@ -0,0 +1,140 @@
+/**
+ * molt - Copyright (C) 2012 Olivier Brunel
+ *
+ * reader.c
+ * Copyright (C) 2012 Olivier Brunel <i.am.jack.mail@gmail.com>
+ *
+ * This file is part of molt.
+ *
+ * molt is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * molt is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * molt. If not, see http://www.gnu.org/licenses/
+ */
+
+#define _GNU_SOURCE     /* for fileno() */
+
+/* C */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* molt */
+#include "reader.h"
+
+#define READER_BUF_SIZE     65536
+
+/* reads records (e.g. file names) separated by delim from a stream. There's
+ * no limit on the length of a record, the buffer simply grows as needed */
+struct _reader_t {
+    gint    fd;
+    gchar   delim;
+    gchar  *buf;
+    gsize   alloc;
+    gsize   start;      /* start of the next record */
+    gsize   end;        /* end of data read */
+    gboolean eof;
+};
+
+reader_t *
+reader_new (FILE *stream, gchar delim)
+{
+    reader_t *reader;
+    
+    reader = g_slice_new0 (reader_t);
+    reader->fd = fileno (stream);
+    reader->delim = delim;
+    reader->alloc = READER_BUF_SIZE;
+    reader->buf = g_malloc (reader->alloc * sizeof (*reader->buf));
+    
+    return reader;
+}
+
+/* returns the next record, or NULL when there are none left (error will be
+ * set if that's because reading failed). The record is NULL-terminated, and
+ * points inside the buffer, i.e. it is only valid until the next call */
+gchar *
+reader_next (reader_t *reader, gsize *len, GError **error)
+{
+    gchar   *s;
+    gchar   *record;
+    gssize   n;
+    
+    for (;;)
+    {
+        /* do we have a full record in buffer? */
+        s = memchr (reader->buf + reader->start, reader->delim,
+                    reader->end - reader->start);
+        if (s)
+        {
+            *s = '\0';
+            record = reader->buf + reader->start;
+            *len = (gsize) (s - record);
+            reader->start += *len + 1;
+            return record;
+        }
+        
+        if (reader->eof)
+        {
+            /* last record, without delimiter */
+            if (reader->start < reader->end)
+            {
+                /* there's always room for it, see below */
+                reader->buf[reader->end] = '\0';
+                record = reader->buf + reader->start;
+                *len = reader->end - reader->start;
+                reader->start = reader->end;
+                return record;
+            }
+            return NULL;
+        }
+        
+        /* move what's left of the current record to the front */
+        if (reader->start > 0)
+        {
+            memmove (reader->buf, reader->buf + reader->start,
+                     reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        /* always keep room for a NULL after the data */
+        if (reader->end + 1 >= reader->alloc)
+        {
+            reader->alloc *= 2;
+            reader->buf = g_realloc (reader->buf,
+                                     reader->alloc * sizeof (*reader->buf));
+        }
+        
+        n = read (reader->fd, reader->buf + reader->end,
+                  reader->alloc - reader->end - 1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            g_set_error (error, MOLT_READER_ERROR, 1, "%s", strerror (errno));
+            return NULL;
+        }
+        else if (n == 0)
+        {
+            reader->eof = TRUE;
+        }
+        reader->end += (gsize) n;
+    }
+}
+
+void
+reader_free (reader_t *reader)
+{
+    g_free (reader->buf);
+    g_slice_free (reader_t, reader);
+}
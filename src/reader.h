@@ -0,0 +1,53 @@
+/**
+ * molt - Copyright (C) 2012 Olivier Brunel
+ *
+ * reader.h
+ * Copyright (C) 2012 Olivier Brunel <i.am.jack.mail@gmail.com>
+ *
+ * This file is part of molt.
+ *
+ * molt is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * molt is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * molt. If not, see http://www.gnu.org/licenses/
+ */
+
+#ifndef READER_H
+#define	READER_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/* C */
+#include <stdio.h>
+
+/* glib */
+#include <glib-2.0/glib.h>
+
+#define MOLT_READER_ERROR   g_quark_from_static_string ("molt reader error")
+
+typedef struct _reader_t reader_t;
+
+reader_t *
+reader_new (FILE *stream, gchar delim);
+
+gchar *
+reader_next (reader_t *reader, gsize *len, GError **error);
+
+void
+reader_free (reader_t *reader);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* READER_H */
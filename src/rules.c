@@ -20,377 +20,2067 @@
  * molt. If not, see http://www.gnu.org/licenses/
  */
 
-#define _GNU_SOURCE     /* for strcasestr() in string.h */
-
 #define _UNUSED_            __attribute__ ((unused)) 
 
 /* C */
 #include <string.h>
-#include <ctype.h>
 #include <stdio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* pcre2 */
+#define PCRE2_CODE_UNIT_WIDTH   8
+#include <pcre2.h>
 
 /* molt */
 #include "rules.h"
 #include "internal.h"
+#include "reader.h"
+#include "buffer.h"
+#include "template.h"
 
-gboolean
+extern gchar stdin_delim;
+
+static gboolean
+is_ascii (const gchar *s)
+{
+    for ( ; *s; ++s)
+    {
+        if (*s & 0x80)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* ASCII case conversions are done 16 bytes at a time with SSE2 (always there
+ * on x86_64), the rest (and tails) byte per byte. In both cases bytes are
+ * compared as signed, so non-ASCII ones are never in the range of letters */
+
+/* returns the offset of the first byte in s (of length len) that's either a
+ * letter which case conversion would change, or not ASCII; len if none */
+static gsize
+case_scan (const gchar *s, gsize len, gboolean upper)
+{
+    gchar  first = (upper) ? 'a' : 'A';
+    gchar  last = (upper) ? 'z' : 'Z';
+    gsize  i = 0;
+#ifdef __SSE2__
+    __m128i lo = _mm_set1_epi8 ((gchar) (first - 1));
+    __m128i hi = _mm_set1_epi8 ((gchar) (last + 1));
+    __m128i v;
+    gint    mask;
+    
+    for ( ; i + 16 <= len; i += 16)
+    {
+        v = _mm_loadu_si128 ((const __m128i *) (s + i));
+        /* high bit of the byte, or of its in-range mask */
+        v = _mm_or_si128 (v, _mm_and_si128 (_mm_cmpgt_epi8 (v, lo),
+                                            _mm_cmplt_epi8 (v, hi)));
+        if ((mask = _mm_movemask_epi8 (v)))
+        {
+            return i + (gsize) g_bit_nth_lsf ((gulong) mask, -1);
+        }
+    }
+#endif
+    
+    for ( ; i < len; ++i)
+    {
+        if ((s[i] >= first && s[i] <= last) || (s[i] & 0x80))
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+/* converts the plain ASCII from src into dst (can be the same) to lower/upper
+ * case, up to len bytes or the first non-ASCII one. Returns the number of
+ * bytes done */
+static gsize
+ascii_change_case (gchar *dst, const gchar *src, gsize len, gboolean upper)
+{
+    gchar  first = (upper) ? 'a' : 'A';
+    gchar  last = (upper) ? 'z' : 'Z';
+    gsize  i = 0;
+#ifdef __SSE2__
+    __m128i lo = _mm_set1_epi8 ((gchar) (first - 1));
+    __m128i hi = _mm_set1_epi8 ((gchar) (last + 1));
+    __m128i bit = _mm_set1_epi8 (0x20);
+    __m128i v;
+    __m128i m;
+    
+    for ( ; i + 16 <= len; i += 16)
+    {
+        v = _mm_loadu_si128 ((const __m128i *) (src + i));
+        if (_mm_movemask_epi8 (v))
+        {
+            break;
+        }
+        m = _mm_and_si128 (_mm_cmpgt_epi8 (v, lo), _mm_cmplt_epi8 (v, hi));
+        v = _mm_xor_si128 (v, _mm_and_si128 (m, bit));
+        _mm_storeu_si128 ((__m128i *) (dst + i), v);
+    }
+#endif
+    
+    for ( ; i < len && !(src[i] & 0x80); ++i)
+    {
+        dst[i] = (src[i] >= first && src[i] <= last)
+            ? (gchar) (src[i] ^ 0x20) : src[i];
+    }
+    return i;
+}
+
+/* appends to out name (of length len) converted to lower/upper case. Returns
+ * FALSE if that changes nothing. Runs of plain ASCII are done here (molt
+ * doesn't set the locale, so there's no special casing as for e.g. Turkic
+ * ones), others through glib */
+static gboolean
+change_case (molt_buf_t *out, const gchar *name, gsize len, gboolean upper)
+{
+    gboolean     changed = FALSE;
+    const gchar *s;
+    gsize        i;
+    gsize        n;
+    gchar       *tmp;
+    
+    i = case_scan (name, len, upper);
+    if (i == len)
+    {
+        return FALSE;
+    }
+    
+    buffer_reserve (out, len);
+    buffer_append (out, name, i);
+    while (i < len)
+    {
+        if (!(name[i] & 0x80))
+        {
+            n = ascii_change_case (buffer_reserve (out, len - i), name + i,
+                                   len - i, upper);
+            changed = changed || memcmp (out->str + out->len, name + i, n) != 0;
+            out->len += n;
+            out->str[out->len] = '\0';
+            i += n;
+            continue;
+        }
+        
+        /* up to the next ASCII byte, plus the char after it, for context
+         * (e.g. Greek final sigma) */
+        for (s = name + i; *s & 0x80; ++s)
+            ;
+        if (*s)
+        {
+            ++s;
+        }
+        n = (gsize) (s - (name + i));
+        tmp = (upper) ? g_utf8_strup (name + i, (gssize) n)
+            : g_utf8_strdown (name + i, (gssize) n);
+        changed = changed || strlen (tmp) != n
+            || memcmp (tmp, name + i, n) != 0;
+        buffer_append (out, tmp, strlen (tmp));
+        g_free (tmp);
+        i += n;
+    }
+    
+    return changed;
+}
+
+rule_result_t
 rule_to_lower (gpointer    *data _UNUSED_,
                const gchar *name,
-               gchar      **new_name,
+               gsize        len,
+               molt_buf_t  *out,
                GError     **error _UNUSED_)
 {
-	*new_name = g_utf8_strdown (name, -1);
-	return TRUE;
+    return (change_case (out, name, len, FALSE))
+        ? RULE_RESULT_CHANGED : RULE_RESULT_UNCHANGED;
 }
 
-gboolean
+rule_result_t
 rule_to_upper (gpointer    *data _UNUSED_,
                const gchar *name,
-               gchar      **new_name,
+               gsize        len,
+               molt_buf_t  *out,
                GError     **error _UNUSED_)
 {
-    *new_name = g_utf8_strup (name, -1);
-    return TRUE;
+    return (change_case (out, name, len, TRUE))
+        ? RULE_RESULT_CHANGED : RULE_RESULT_UNCHANGED;
 }
 
-gboolean
-rule_camel (gpointer    *data _UNUSED_,
-            const gchar *name,
-            gchar      **new_name,
-            GError     **error _UNUSED_)
+/* appends to out name (of length len) in Camel Case, returns FALSE if that
+ * changes nothing: all in lowercase, but the first char and those following
+ * punctuation/symbols, in titlecase. The extension (from the last dot) is
+ * only put in lowercase. Done in one pass, decoding each char only once */
+static gboolean
+camel_case (molt_buf_t *out, const gchar *name, gsize len)
 {
-    gchar *s;
-    gchar *e;
-    gboolean do_next= TRUE;
+    molt_buf_t   buf;
+    const gchar *ext;
+    const gchar *s;
+    const gchar *next;
+    gboolean     do_next = TRUE;
+    gunichar     c;
     
-    /* to lower */
-    *new_name = g_utf8_strdown (name, -1);
-    /* find the last dot, considered the extension */
-    e = strrchr (*new_name, '.');
-    /* we'll turn to upper each char after a space/punct, but not touch the ext */
-    for (s = *new_name; *s != '\0' && (!e || s < e); ++s)
+    ext = strrchr (name, '.');
+    buffer_reserve (out, len);
+    buf = *out;
+    
+    for (s = name; *s; s = next)
     {
-        if (ispunct (*s))
+        buffer_reserve (&buf, 6);
+        if (!(*s & 0x80))
+        {
+            next = s + 1;
+            if (g_ascii_ispunct (*s))
+            {
+                do_next = TRUE;
+                buf.str[buf.len++] = *s;
+            }
+            else if (do_next && (!ext || s < ext))
+            {
+                buf.str[buf.len++] = g_ascii_toupper (*s);
+                do_next = FALSE;
+            }
+            else
+            {
+                buf.str[buf.len++] = g_ascii_tolower (*s);
+                do_next = FALSE;
+            }
+            continue;
+        }
+        
+        c = g_utf8_get_char_validated (s, -1);
+        if (c == (gunichar) -1 || c == (gunichar) -2)
+        {
+            /* not UTF-8, left as is */
+            next = s + 1;
+            buf.str[buf.len++] = *s;
+            continue;
+        }
+        next = g_utf8_next_char (s);
+        
+        if (g_unichar_ispunct (c))
         {
             do_next = TRUE;
         }
-        else if (do_next)
+        else if (do_next && (!ext || s < ext))
+        {
+            c = g_unichar_totitle (c);
+            do_next = FALSE;
+        }
+        else if (c == 0x03A3)
+        {
+            /* Greek capital sigma: final form if not followed by a letter,
+             * as g_utf8_strdown() does */
+            c = (g_unichar_isalpha (g_utf8_get_char_validated (next, -1)))
+                ? 0x03C3 : 0x03C2;
+            do_next = FALSE;
+        }
+        else
         {
-            *s = (gchar) toupper (*s);
+            c = g_unichar_tolower (c);
             do_next = FALSE;
         }
+        buf.len += (gsize) g_unichar_to_utf8 (c, buf.str + buf.len);
     }
+    buf.str[buf.len] = '\0';
+    *out = buf;
     
-    return TRUE;
+    return buf.len != len || memcmp (buf.str, name, len) != 0;
 }
 
-typedef gchar *(*strstr_fn) (const gchar *haystack, const gchar *needle);
-typedef struct {
+rule_result_t
+rule_camel (gpointer    *data _UNUSED_,
+            const gchar *name,
+            gsize        len,
+            molt_buf_t  *out,
+            GError     **error _UNUSED_)
+{
+    return (camel_case (out, name, len))
+        ? RULE_RESULT_CHANGED : RULE_RESULT_UNCHANGED;
+}
+
+/* case-sensitive needles shorter than this are looked for with memchr() on
+ * their first byte, longer ones (and all case-insensitive ASCII ones) using
+ * Horspool */
+#define SR_HORSPOOL_MIN     4
+
+typedef struct _sr_t sr_t;
+
+/* returns the first match of sr in [s, end), with its length in len */
+typedef const gchar *(*sr_find_fn) (const sr_t  *sr,
+                                    const gchar *s,
+                                    const gchar *end,
+                                    gsize       *len);
+
+struct _sr_t {
     const gchar *search;
     size_t       len_search;
     const gchar *replace;
     size_t       len_replace;
-    strstr_fn    strstr;
-} sr_t;
+    sr_find_fn   find;
+    /* what's actually looked for: search, or its lowercase version (folded,
+     * owned) for option i */
+    const gchar *needle;
+    gchar       *folded;
+    /* Horspool: bytes as compared to needle, and how far to move the window
+     * based on its last (folded) byte */
+    guchar       fold[256];
+    gsize        shift[256];
+};
+
+static const gchar *
+sr_find_short (const sr_t  *sr,
+               const gchar *s,
+               const gchar *end,
+               gsize       *len)
+{
+    const gchar *last;
+    gsize        n = sr->len_search;
+    
+    if ((gsize) (end - s) < n)
+    {
+        return NULL;
+    }
+    *len = n;
+    /* last possible start of a match */
+    last = end - n;
+    while (s <= last
+            && (s = memchr (s, sr->needle[0], (gsize) (last - s) + 1)))
+    {
+        if (s[n - 1] == sr->needle[n - 1]
+                && memcmp (s + 1, sr->needle + 1, n - 1) == 0)
+        {
+            return s;
+        }
+        ++s;
+    }
+    return NULL;
+}
+
+static const gchar *
+sr_find_horspool (const sr_t  *sr,
+                  const gchar *s,
+                  const gchar *end,
+                  gsize       *len)
+{
+    gsize n = sr->len_search - 1;
+    gsize i;
+    
+    *len = sr->len_search;
+    while ((gsize) (end - s) > n)
+    {
+        for (i = n; sr->fold[(guchar) s[i]] == (guchar) sr->needle[i]; --i)
+        {
+            if (i == 0)
+            {
+                return s;
+            }
+        }
+        s += sr->shift[sr->fold[(guchar) s[n]]];
+    }
+    return NULL;
+}
+
+/* returns the end of the case-insensitive match of needle (lowercase, valid
+ * UTF-8) at s, or NULL */
+static const gchar *
+sr_match_utf8_i (const gchar *needle, const gchar *s, const gchar *end)
+{
+    gunichar c;
+    
+    for ( ; *needle; needle = g_utf8_next_char (needle))
+    {
+        if (s >= end)
+        {
+            return NULL;
+        }
+        c = g_utf8_get_char_validated (s, end - s);
+        if (c == (gunichar) -1 || c == (gunichar) -2
+                || g_unichar_tolower (c) != g_utf8_get_char (needle))
+        {
+            return NULL;
+        }
+        s = g_utf8_next_char (s);
+    }
+    return s;
+}
+
+static const gchar *
+sr_find_utf8_i (const sr_t  *sr,
+                const gchar *s,
+                const gchar *end,
+                gsize       *len)
+{
+    const gchar *e;
+    gsize        skip;
+    
+    while (s < end)
+    {
+        if ((e = sr_match_utf8_i (sr->needle, s, end)))
+        {
+            *len = (gsize) (e - s);
+            return s;
+        }
+        /* invalid UTF-8 could claim to go past end */
+        skip = (gsize) g_utf8_skip[(guchar) *s];
+        s = (skip < (gsize) (end - s)) ? s + skip : end;
+    }
+    return NULL;
+}
+
+/* sets up sr (whose search was set) to look for search, case-insensitively
+ * if caseless */
+static void
+sr_set_needle (sr_t *d, gboolean caseless)
+{
+    const gchar *s;
+    GString *str;
+    gsize i;
+    
+    for (i = 0; i < 256; ++i)
+    {
+        d->fold[i] = (guchar) i;
+    }
+    if (!caseless)
+    {
+        d->needle = d->search;
+        d->find = (d->len_search < SR_HORSPOOL_MIN)
+            ? sr_find_short : sr_find_horspool;
+    }
+    else if (is_ascii (d->search) || !g_utf8_validate (d->search, -1, NULL))
+    {
+        /* only ASCII letters can match in different cases, which can then be
+         * done byte per byte */
+        d->folded = g_ascii_strdown (d->search, -1);
+        d->needle = d->folded;
+        for (i = 'A'; i <= 'Z'; ++i)
+        {
+            d->fold[i] = (guchar) g_ascii_tolower ((gchar) i);
+        }
+        d->find = sr_find_horspool;
+    }
+    else
+    {
+        /* compared char per char, in lowercase */
+        str = g_string_sized_new (d->len_search);
+        for (s = d->search; *s; s = g_utf8_next_char (s))
+        {
+            g_string_append_unichar (str, g_unichar_tolower (g_utf8_get_char (s)));
+        }
+        d->folded = g_string_free (str, FALSE);
+        d->needle = d->folded;
+        d->find = sr_find_utf8_i;
+    }
+    
+    if (d->find == sr_find_horspool)
+    {
+        for (i = 0; i < 256; ++i)
+        {
+            d->shift[i] = d->len_search;
+        }
+        for (i = 0; i < d->len_search - 1; ++i)
+        {
+            d->shift[(guchar) d->needle[i]] = d->len_search - 1 - i;
+        }
+    }
+}
+
+gboolean
+rule_sr_init (gpointer  *data,
+              GPtrArray *params,
+              GError   **error)
+{
+    sr_t *d;
+    gchar *options = NULL;
+    
+    /* make sure we have something to search for */
+    if (!params || params->len < 1)
+    {
+        g_set_error (error, MOLT_RULE_ERROR, 1,
+                     "Parameter(s) missing");
+        return FALSE;
+    }
+    else if (*((gchar *) g_ptr_array_index (params, 0)) == '\0')
+    {
+        g_set_error (error, MOLT_RULE_ERROR, 1,
+                     "Nothing to search for");
+        return FALSE;
+    }
+    /* and not too many params */
+    else if (params->len > 3)
+    {
+        g_set_error (error, MOLT_RULE_ERROR, 1,
+                     "Too many parameters; syntax: search[/replace[/options]]");
+        return FALSE;
+    }
+    
+    *data = g_malloc0 (sizeof (*d));
+    d = *data;
+    
+    d->search = g_ptr_array_index (params, 0);
+    d->len_search = strlen (d->search);
+    if (params->len >= 2)
+    {
+        d->replace = g_ptr_array_index (params, 1);
+        d->len_replace = strlen (d->replace);
+    }
+    
+    if (params->len == 3)
+    {
+        options = g_ptr_array_index (params, 2);
+    }
+    
+    sr_set_needle (d, options && strcmp (options, "i") == 0);
+    
+    return TRUE;
+}
+
+void
+rule_sr_destroy (gpointer *data)
+{
+    sr_t *sr = *data;
+    
+    g_free (sr->folded);
+    g_free (sr);
+}
+
+/* appends to out name (of length len) with all matches of sr replaced.
+ * Returns FALSE if nothing was found, out being then left untouched */
+static gboolean
+sr_replace (const sr_t  *sr,
+            const gchar *name,
+            gsize        len,
+            molt_buf_t  *out)
+{
+    const gchar *end = name + len;
+    const gchar *s = name;
+    const gchar *e;
+    gsize        len_match;
+    
+    while ((e = sr->find (sr, s, end, &len_match)))
+    {
+        buffer_append (out, s, (gsize) (e - s));
+        if (sr->replace)
+        {
+            buffer_append (out, sr->replace, sr->len_replace);
+        }
+        s = e + len_match;
+    }
+    
+    if (s == name)
+    {
+        return FALSE;
+    }
+    buffer_append (out, s, (gsize) (end - s));
+    return TRUE;
+}
+
+rule_result_t
+rule_sr (gpointer    *_data,
+         const gchar *name,
+         gsize        len,
+         molt_buf_t  *out,
+         GError     **error _UNUSED_)
+{
+    return (sr_replace (*_data, name, len, out))
+        ? RULE_RESULT_CHANGED : RULE_RESULT_UNCHANGED;
+}
+
+/* dict: search & replace of all the pairs from a file at once, using an
+ * Aho-Corasick automaton. Matches are leftmost-longest, and what was put in
+ * as replacement isn't searched again */
+typedef struct {
+    const gchar *replace;
+    gsize        len_replace;
+    gsize        len_search;
+} dict_entry_t;
+
+typedef struct {
+    guint   child;      /* first child, 0 if none (root can't be a child) */
+    guint   sibling;    /* next child of the same parent, 0 if none */
+    guint   fail;       /* longest proper suffix in the trie */
+    gint    entry;      /* longest entry ending here, -1 if none */
+    gsize   depth;
+    guchar  c;
+} dict_state_t;
+
+typedef struct {
+    gchar   *contents;  /* of the file, where entries point to */
+    GArray  *entries;
+    GArray  *states;    /* 0 is the root */
+    guint    root[256]; /* root's children, indexed by byte */
+} dict_t;
+
+#define dict_state(d, i)    (&g_array_index ((d)->states, dict_state_t, (i)))
+
+static guint
+dict_child (dict_t *d, guint state, guchar c)
+{
+    guint i;
+    
+    if (state == 0)
+    {
+        return d->root[c];
+    }
+    for (i = dict_state (d, state)->child; i; i = dict_state (d, i)->sibling)
+    {
+        if (dict_state (d, i)->c == c)
+        {
+            return i;
+        }
+    }
+    return 0;
+}
+
+static guint
+dict_next (dict_t *d, guint state, guchar c)
+{
+    guint next;
+    
+    while (state && !(next = dict_child (d, state, c)))
+    {
+        state = dict_state (d, state)->fail;
+    }
+    return (state) ? next : d->root[c];
+}
+
+static void
+dict_add (dict_t *d, const gchar *search, gint entry)
+{
+    dict_state_t  new_state = { 0, 0, 0, -1, 0, 0 };
+    dict_state_t *st;
+    guint         state = 0;
+    guint         next;
+    
+    for ( ; *search; ++search)
+    {
+        if (!(next = dict_child (d, state, (guchar) *search)))
+        {
+            next = d->states->len;
+            new_state.c = (guchar) *search;
+            new_state.depth = dict_state (d, state)->depth + 1;
+            if (state == 0)
+            {
+                d->root[new_state.c] = next;
+            }
+            else
+            {
+                new_state.sibling = dict_state (d, state)->child;
+                dict_state (d, state)->child = next;
+            }
+            g_array_append_val (d->states, new_state);
+        }
+        state = next;
+    }
+    /* in case of duplicates, the last one wins */
+    st = dict_state (d, state);
+    st->entry = entry;
+}
+
+/* sets fail links, breadth-first so they're known for all shorter states */
+static void
+dict_link (dict_t *d)
+{
+    guint *queue;
+    guint  head = 0;
+    guint  tail = 0;
+    guint  state;
+    guint  i;
+    dict_state_t *st;
+    
+    queue = g_new (guint, d->states->len);
+    for (i = 0; i < 256; ++i)
+    {
+        if (d->root[i])
+        {
+            queue[tail++] = d->root[i];
+        }
+    }
+    while (head < tail)
+    {
+        state = queue[head++];
+        for (i = dict_state (d, state)->child; i; i = st->sibling)
+        {
+            st = dict_state (d, i);
+            st->fail = dict_next (d, dict_state (d, state)->fail, st->c);
+            if (st->entry < 0)
+            {
+                st->entry = dict_state (d, st->fail)->entry;
+            }
+            queue[tail++] = i;
+        }
+    }
+    g_free (queue);
+}
+
+gboolean
+rule_dict_init (gpointer  *data,
+                GPtrArray *params,
+                GError   **error)
+{
+    GError       *local_err = NULL;
+    dict_t       *d;
+    dict_entry_t  entry;
+    dict_state_t  root = { 0, 0, 0, -1, 0, 0 };
+    gchar        *line;
+    gchar        *next;
+    gchar        *s;
+    guint         nb;
+    
+    if (!params || params->len != 1)
+    {
+        g_set_error (error, MOLT_RULE_ERROR, 1,
+                     "File missing");
+        return FALSE;
+    }
+    
+    d = g_malloc0 (sizeof (*d));
+    if (!g_file_get_contents (g_ptr_array_index (params, 0), &d->contents,
+                              NULL, &local_err))
+    {
+        g_set_error (error, MOLT_RULE_ERROR, 1, "Unable to read file: %s",
+                     local_err->message);
+        g_clear_error (&local_err);
+        g_free (d);
+        return FALSE;
+    }
+    d->entries = g_array_new (FALSE, FALSE, sizeof (dict_entry_t));
+    d->states = g_array_new (FALSE, FALSE, sizeof (dict_state_t));
+    g_array_append_val (d->states, root);
+    *data = d;
+    
+    /* one entry per line: search[<TAB>replacement] */
+    for (nb = 1, line = d->contents; *line; line = next, ++nb)
+    {
+        if ((next = strchr (line, '\n')))
+        {
+            *next++ = '\0';
+        }
+        else
+        {
+            next = line + strlen (line);
+        }
+        
+        if (*line == '\0')
+        {
+            continue;
+        }
+        else if (*line == '\t')
+        {
+            g_set_error (error, MOLT_RULE_ERROR, 1,
+                         "Nothing to search for on line %u", nb);
+            rule_dict_destroy (data);
+            return FALSE;
+        }
+        
+        entry.replace = NULL;
+        entry.len_replace = 0;
+        if ((s = strchr (line, '\t')))
+        {
+            *s++ = '\0';
+            entry.replace = s;
+            entry.len_replace = strlen (s);
+        }
+        entry.len_search = strlen (line);
+        dict_add (d, line, (gint) d->entries->len);
+        g_array_append_val (d->entries, entry);
+    }
+    dict_link (d);
+    
+    debug (LEVEL_DEBUG, "dict: %u entries, %u states\n",
+           d->entries->len, d->states->len);
+    return TRUE;
+}
+
+void
+rule_dict_destroy (gpointer *data)
+{
+    dict_t *d = *data;
+    
+    g_array_free (d->entries, TRUE);
+    g_array_free (d->states, TRUE);
+    g_free (d->contents);
+    g_free (d);
+}
+
+rule_result_t
+rule_dict (gpointer    *data,
+           const gchar *name,
+           gsize        len,
+           molt_buf_t  *out,
+           GError     **error _UNUSED_)
+{
+    dict_t       *d = *data;
+    dict_state_t *st = dict_state (d, 0);
+    dict_entry_t *entry = NULL;
+    dict_entry_t *e;
+    const gchar  *s = name;     /* what's yet to be copied */
+    const gchar  *p = name;     /* what's yet to be read */
+    const gchar  *match = NULL; /* start of best match so far */
+    const gchar  *start;
+    guint         state = 0;
+    
+    for (;;)
+    {
+        if (*p)
+        {
+            state = dict_next (d, state, (guchar) *p++);
+            st = dict_state (d, state);
+            if (st->entry >= 0)
+            {
+                e = &g_array_index (d->entries, dict_entry_t, st->entry);
+                start = p - e->len_search;
+                /* ends later, so starting as early means longer */
+                if (!match || start <= match)
+                {
+                    match = start;
+                    entry = e;
+                }
+            }
+        }
+        else if (!match)
+        {
+            break;
+        }
+        
+        /* all matches still possible start after this one: replace it */
+        if (match && (!*p || (gsize) (p - match) > st->depth))
+        {
+            buffer_append (out, s, (gsize) (match - s));
+            if (entry->replace)
+            {
+                buffer_append (out, entry->replace, entry->len_replace);
+            }
+            s = p = match + entry->len_search;
+            match = NULL;
+            state = 0;
+        }
+    }
+    
+    if (s == name)
+    {
+        return RULE_RESULT_UNCHANGED;
+    }
+    buffer_append (out, s, len - (gsize) (s - name));
+    return RULE_RESULT_CHANGED;
+}
+
+typedef struct {
+    FILE     *stream;
+    reader_t *reader;
+} list_t;
+
+gboolean
+rule_list_init (gpointer  *data,
+                GPtrArray *params _UNUSED_,
+                GError   **error)
+{
+    GError *local_err = NULL;
+    FILE   *stream;
+    list_t *d;
+    
+    if (G_UNLIKELY (!get_stdin ((gpointer *) &stream, &local_err)))
+    {
+        g_set_error (error, MOLT_RULE_ERROR, 1, "Unable to get stdin: %s",
+                     local_err->message);
+        g_clear_error (&local_err);
+        return FALSE;
+    }
+    
+    *data = g_malloc0 (sizeof (*d));
+    d = *data;
+    d->stream = stream;
+    
+    return TRUE;
+}
+
+void
+rule_list_destroy (gpointer *data)
+{
+    list_t *d = *data;
+    
+    if (d->reader)
+    {
+        reader_free (d->reader);
+    }
+    g_free (d);
+}
+
+rule_result_t
+rule_list (gpointer    *data,
+           const gchar *name _UNUSED_,
+           gsize        len_name _UNUSED_,
+           molt_buf_t  *out,
+           GError     **error)
+{
+    GError *local_err = NULL;
+    list_t *d = *data;
+    gchar  *s;
+    gsize   len;
+    
+    /* created on first use, so option --null can be specified after us */
+    if (!d->reader)
+    {
+        d->reader = reader_new (d->stream, stdin_delim);
+    }
+    
+    s = reader_next (d->reader, &len, &local_err);
+    if (G_UNLIKELY (local_err))
+    {
+        g_set_error (error, MOLT_RULE_ERROR, 1, "Unable to read stdin: %s",
+                     local_err->message);
+        g_clear_error (&local_err);
+        return RULE_RESULT_ERROR;
+    }
+    else if (!s)
+    {
+        /* success w/out a name, so if there are more files than names on the
+         * list given on stdin, we just don't rename the last files (at least,
+         * not by this rule anyways) */
+        return RULE_RESULT_UNCHANGED;
+    }
+    
+    /* names are separated by newlines (or NULLs with --null), which are not
+     * part of the name, and already stripped by the reader */
+    buffer_append (out, s, len);
+    return RULE_RESULT_CHANGED;
+}
+
+/* map: new names looked up from a table of old & new names, through an open
+ * addressing (linear probing) hash index over the mapped file */
+typedef struct {
+    gsize   offset;     /* of the old name in the file */
+    guint32 len;        /* of the old name, 0 for an empty slot */
+    guint32 hash;
+} map_slot_t;
+
+typedef struct {
+    GMappedFile *file;
+    const gchar *contents;
+    gsize        length;
+    gchar        delim;     /* after a new name: '\n' or '\0' */
+    map_slot_t  *slots;
+    gsize        mask;      /* number of slots - 1 */
+} map_t;
+
+/* FNV-1a */
+static guint32
+map_hash (const gchar *s, gsize len)
+{
+    guint32 hash = 2166136261u;
+    gsize   i;
+    
+    for (i = 0; i < len; ++i)
+    {
+        hash ^= (guchar) s[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* returns the slot for old name s, either its own or the empty one to use */
+static map_slot_t *
+map_slot (map_t *map, const gchar *s, gsize len, guint32 hash)
+{
+    map_slot_t *slot;
+    gsize       i;
+    
+    for (i = hash & map->mask; ; i = (i + 1) & map->mask)
+    {
+        slot = &map->slots[i];
+        if (slot->len == 0
+                || (slot->hash == hash && slot->len == len
+                    && memcmp (map->contents + slot->offset, s, len) == 0))
+        {
+            return slot;
+        }
+    }
+}
+
+gboolean
+rule_map_init (gpointer  *data,
+               GPtrArray *params,
+               GError   **error)
+{
+    GError      *local_err = NULL;
+    map_t       *map;
+    map_slot_t  *slot;
+    const gchar *s;
+    const gchar *e;
+    const gchar *t;
+    const gchar *end;
+    gsize        nb;
+    gsize        size;
+    guint        line;
+    guint32      hash;
+    
+    if (!params || params->len != 1)
+    {
+        g_set_error (error, MOLT_RULE_ERROR, 1,
+                     "File missing");
+        return FALSE;
+    }
+    
+    map = g_malloc0 (sizeof (*map));
+    if (!(map->file = g_mapped_file_new (g_ptr_array_index (params, 0), FALSE,
+                                         &local_err)))
+    {
+        g_set_error (error, MOLT_RULE_ERROR, 1, "Unable to read file: %s",
+                     local_err->message);
+        g_clear_error (&local_err);
+        g_free (map);
+        return FALSE;
+    }
+    map->contents = g_mapped_file_get_contents (map->file);
+    map->length = g_mapped_file_get_length (map->file);
+    end = map->contents + map->length;
+    *data = map;
+    
+    /* with a NULL anywhere, it's old\0new\0 else lines of old<TAB>new */
+    map->delim = (map->length > 0 && memchr (map->contents, '\0', map->length))
+        ? '\0' : '\n';
+    
+    /* at most one entry per delimiter (plus one if the last has none), and
+     * less than 3/4 of the slots used */
+    for (nb = 1, s = map->contents;
+            s < end && (s = memchr (s, map->delim, (gsize) (end - s)));
+            ++s)
+    {
+        ++nb;
+    }
+    for (size = 16; size / 4 * 3 <= nb; size *= 2)
+        ;
+    map->slots = g_new0 (map_slot_t, size);
+    map->mask = size - 1;
+    
+    for (line = 1, s = map->contents; s < end; s = e + 1, ++line)
+    {
+        if (!(e = memchr (s, map->delim, (gsize) (end - s))))
+        {
+            e = end;
+        }
+        
+        if (map->delim == '\n')
+        {
+            /* old<TAB>new, empty lines being ignored */
+            if (s == e)
+            {
+                continue;
+            }
+            else if (!(t = memchr (s, '\t', (gsize) (e - s))))
+            {
+                g_set_error (error, MOLT_RULE_ERROR, 1,
+                             "No new name on line %u", line);
+                rule_map_destroy (data);
+                return FALSE;
+            }
+        }
+        else
+        {
+            /* old\0new\0 */
+            t = e;
+            if (t == end)
+            {
+                g_set_error (error, MOLT_RULE_ERROR, 1,
+                             "No new name for entry %u", line);
+                rule_map_destroy (data);
+                return FALSE;
+            }
+            if (!(e = memchr (t + 1, '\0', (gsize) (end - t - 1))))
+            {
+                e = end;
+            }
+        }
+        
+        if (t == s || G_UNLIKELY ((gsize) (t - s) > G_MAXUINT32))
+        {
+            g_set_error (error, MOLT_RULE_ERROR, 1,
+                         "Invalid old name for entry %u", line);
+            rule_map_destroy (data);
+            return FALSE;
+        }
+        
+        /* in case of duplicates, the last one wins */
+        hash = map_hash (s, (gsize) (t - s));
+        slot = map_slot (map, s, (gsize) (t - s), hash);
+        slot->offset = (gsize) (s - map->contents);
+        slot->len = (guint32) (t - s);
+        slot->hash = hash;
+    }
+    
+    debug (LEVEL_DEBUG, "map: %" G_GSIZE_FORMAT " slots for %u entries\n",
+           size, line - 1);
+    return TRUE;
+}
+
+void
+rule_map_destroy (gpointer *data)
+{
+    map_t *map = *data;
+    
+    g_mapped_file_unref (map->file);
+    g_free (map->slots);
+    g_free (map);
+}
+
+rule_result_t
+rule_map (gpointer    *data,
+          const gchar *name,
+          gsize        len,
+          molt_buf_t  *out,
+          GError     **error _UNUSED_)
+{
+    map_t       *map = *data;
+    map_slot_t  *slot;
+    const gchar *s;
+    const gchar *e;
+    const gchar *end;
+    
+    slot = map_slot (map, name, len, map_hash (name, len));
+    if (slot->len == 0)
+    {
+        /* not in the table, left as is */
+        return RULE_RESULT_UNCHANGED;
+    }
+    
+    end = map->contents + map->length;
+    s = map->contents + slot->offset + slot->len + 1;
+    if (!(e = memchr (s, map->delim, (gsize) (end - s))))
+    {
+        e = end;
+    }
+    buffer_append (out, s, (gsize) (e - s));
+    return RULE_RESULT_CHANGED;
+}
+
+/* regex: PCRE2, JIT compiled when supported. The replacement is parsed on init
+ * (same syntax as GRegex) and expanded for each match straight into the output,
+ * and match data are kept per thread */
+typedef enum {
+    REPL_STRING = 0,    /* text, case changes apply */
+    REPL_CHARACTER,     /* a byte, as is */
+    REPL_REFERENCE,     /* a captured substring */
+    REPL_CHANGE_CASE
+} repl_type_t;
+
+typedef enum {
+    CHANGE_CASE_NONE = 0,
+    CHANGE_CASE_UPPER,
+    CHANGE_CASE_LOWER,
+    CHANGE_CASE_UPPER_SINGLE,
+    CHANGE_CASE_LOWER_SINGLE
+} change_case_t;
+
+typedef struct {
+    repl_type_t  type;
+    gchar       *text;      /* STRING */
+    gsize        len;       /* STRING */
+    gint         value;     /* CHARACTER: byte; REFERENCE: group number (-1 for
+                               an unknown name); CHANGE_CASE: change_case_t */
+} repl_t;
+
+/* capture group, whose value (in the first match) is set as variable RE */
+typedef struct {
+    gchar       *key;       /* as in the cache of values, e.g. "RE:1" */
+    uint32_t     group;
+} capture_var_t;
+
+typedef struct {
+    pcre2_code  *code;
+    GArray      *replacement;
+    GArray      *captures;  /* capture_var_t, numbered then named groups */
+} regex_t;
+
+/* match data of the current thread, large enough for all patterns */
+static GPrivate regex_match_data =
+    G_PRIVATE_INIT ((GDestroyNotify) pcre2_match_data_free);
+static guint32  regex_ovector_size = 1;
+
+/* returns the match data of the current thread */
+static pcre2_match_data *
+regex_get_match_data (void)
+{
+    pcre2_match_data *match_data;
+    
+    match_data = g_private_get (&regex_match_data);
+    if (G_UNLIKELY (!match_data
+                || pcre2_get_ovector_count (match_data) < regex_ovector_size))
+    {
+        match_data = pcre2_match_data_create (regex_ovector_size, NULL);
+        g_private_replace (&regex_match_data, match_data);
+    }
+    return match_data;
+}
+
+static void
+regex_free (regex_t *regex)
+{
+    guint i;
+    
+    if (regex->replacement)
+    {
+        for (i = 0; i < regex->replacement->len; ++i)
+        {
+            g_free (g_array_index (regex->replacement, repl_t, i).text);
+        }
+        g_array_free (regex->replacement, TRUE);
+    }
+    if (regex->captures)
+    {
+        for (i = 0; i < regex->captures->len; ++i)
+        {
+            g_free (g_array_index (regex->captures, capture_var_t, i).key);
+        }
+        g_array_free (regex->captures, TRUE);
+    }
+    pcre2_code_free (regex->code);
+    g_free (regex);
+}
+
+/* parses the escape sequence (after the backslash) at *p into repl, moving p
+ * past it. Returns NULL on success, else the error message */
+static const gchar *
+parse_escape (pcre2_code *code, const gchar **p, repl_t *repl)
+{
+    const gchar *s = *p;
+    const gchar *q;
+    gchar       *name;
+    gunichar     x = 0;
+    gint         base = 0;
+    gint         d = 0;
+    gint         h;
+    gint         i;
+    
+    repl->type = REPL_CHARACTER;
+    switch (*s)
+    {
+        case 't':
+            repl->value = '\t';
+            break;
+        case 'n':
+            repl->value = '\n';
+            break;
+        case 'v':
+            repl->value = '\v';
+            break;
+        case 'r':
+            repl->value = '\r';
+            break;
+        case 'f':
+            repl->value = '\f';
+            break;
+        case 'e':
+            repl->value = '\033';
+            break;
+        case 'a':
+            repl->value = '\007';
+            break;
+        case '\\':
+            repl->value = '\\';
+            break;
+        case 'l':
+        case 'u':
+        case 'L':
+        case 'U':
+        case 'E':
+            repl->type = REPL_CHANGE_CASE;
+            repl->value = (*s == 'l') ? CHANGE_CASE_LOWER_SINGLE
+                : (*s == 'u') ? CHANGE_CASE_UPPER_SINGLE
+                : (*s == 'L') ? CHANGE_CASE_LOWER
+                : (*s == 'U') ? CHANGE_CASE_UPPER
+                : CHANGE_CASE_NONE;
+            break;
+        case 'x':
+            ++s;
+            if (*s == '{')
+            {
+                do
+                {
+                    ++s;
+                    if ((h = g_ascii_xdigit_value (*s)) < 0)
+                    {
+                        return "hexadecimal digit or '}' expected";
+                    }
+                    x = x * 16 + (gunichar) h;
+                } while (s[1] != '}');
+                ++s;
+            }
+            else
+            {
+                for (i = 0; i < 2; ++i, ++s)
+                {
+                    if ((h = g_ascii_xdigit_value (*s)) < 0)
+                    {
+                        return "hexadecimal digit expected";
+                    }
+                    x = x * 16 + (gunichar) h;
+                }
+                --s;
+            }
+            repl->type = REPL_STRING;
+            repl->text = g_malloc0 (8);
+            repl->len = (gsize) g_unichar_to_utf8 (x, repl->text);
+            break;
+        case 'g':
+            if (*++s != '<')
+            {
+                return "missing '<' in symbolic reference";
+            }
+            q = ++s;
+            for ( ; *s != '>'; ++s)
+            {
+                if (*s == '\0')
+                {
+                    return "unfinished symbolic reference";
+                }
+            }
+            if (s == q)
+            {
+                return "zero-length symbolic reference";
+            }
+            repl->type = REPL_REFERENCE;
+            if (g_ascii_isdigit (*q))
+            {
+                for ( ; q < s; ++q)
+                {
+                    if ((h = g_ascii_digit_value (*q)) < 0)
+                    {
+                        return "digit expected";
+                    }
+                    d = d * 10 + h;
+                }
+                repl->value = d;
+            }
+            else
+            {
+                for (i = 0; q + i < s; ++i)
+                {
+                    if (!g_ascii_isalnum (q[i]) && q[i] != '_')
+                    {
+                        return "illegal symbolic reference";
+                    }
+                }
+                name = g_strndup (q, (gsize) i);
+                repl->value = pcre2_substring_number_from_name (code,
+                        (PCRE2_SPTR) name);
+                g_free (name);
+                if (repl->value < 0)
+                {
+                    repl->value = -1;
+                }
+            }
+            break;
+        case '0':
+            /* \0 followed by digits is an octal char, else the whole match */
+            if (g_ascii_isdigit (s[1]))
+            {
+                base = 8;
+                ++s;
+            }
+            /* fall through */
+        case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            /* up to 2 digits for a reference; 3 octal digits make a char */
+            for (i = 0; i < 3; ++i, ++s)
+            {
+                if ((h = g_ascii_digit_value (*s)) < 0)
+                {
+                    break;
+                }
+                if (h > 7)
+                {
+                    if (base == 8)
+                    {
+                        break;
+                    }
+                    base = 10;
+                }
+                if (i == 2 && base == 10)
+                {
+                    break;
+                }
+                x = x * 8 + (gunichar) h;
+                d = d * 10 + h;
+            }
+            --s;
+            if (base == 8 || i == 3)
+            {
+                repl->type = REPL_STRING;
+                repl->text = g_malloc0 (8);
+                repl->len = (gsize) g_unichar_to_utf8 (x, repl->text);
+            }
+            else
+            {
+                repl->type = REPL_REFERENCE;
+                repl->value = d;
+            }
+            break;
+        case '\0':
+            return "stray final '\\'";
+        default:
+            return "unknown escape sequence";
+    }
+    
+    *p = s + 1;
+    return NULL;
+}
+
+static gboolean
+parse_replacement (regex_t *regex, const gchar *replacement, GError **error)
+{
+    const gchar *p = replacement;
+    const gchar *s;
+    const gchar *err;
+    repl_t       repl;
+    
+    regex->replacement = g_array_new (FALSE, FALSE, sizeof (repl_t));
+    while (*p)
+    {
+        memset (&repl, 0, sizeof (repl));
+        if (*p != '\\')
+        {
+            s = p;
+            if (!(p = strchr (s, '\\')))
+            {
+                p = s + strlen (s);
+            }
+            repl.type = REPL_STRING;
+            repl.len = (gsize) (p - s);
+            repl.text = g_strndup (s, repl.len);
+        }
+        else
+        {
+            s = p++;
+            if ((err = parse_escape (regex->code, &p, &repl)))
+            {
+                g_set_error (error, MOLT_RULE_ERROR, 1,
+                             "Invalid replacement: %s at char %ld",
+                             err, (glong) (s - replacement));
+                return FALSE;
+            }
+        }
+        g_array_append_val (regex->replacement, repl);
+    }
+    
+    return TRUE;
+}
+
+/* lists the nb capture groups of regex (plus the whole match), by number &
+ * name, for their values to be set as variables */
+static void
+set_capture_vars (regex_t *regex, uint32_t nb)
+{
+    capture_var_t  capture;
+    PCRE2_SPTR     table;
+    uint32_t       count;
+    uint32_t       size;
+    uint32_t       i;
+    
+    regex->captures = g_array_sized_new (FALSE, FALSE, sizeof (capture_var_t),
+                                         nb + 1);
+    for (i = 0; i <= nb; ++i)
+    {
+        capture.key = g_strdup_printf ("RE:%u", i);
+        capture.group = i;
+        g_array_append_val (regex->captures, capture);
+    }
+    
+    /* each entry is the group number (2 bytes, most significant first) then
+     * its (NUL-terminated) name */
+    pcre2_pattern_info (regex->code, PCRE2_INFO_NAMECOUNT, &count);
+    pcre2_pattern_info (regex->code, PCRE2_INFO_NAMEENTRYSIZE, &size);
+    pcre2_pattern_info (regex->code, PCRE2_INFO_NAMETABLE, &table);
+    for (i = 0; i < count; ++i, table += size)
+    {
+        capture.key = g_strconcat ("RE:", (const gchar *) table + 2, NULL);
+        capture.group = (uint32_t) (table[0] << 8 | table[1]);
+        g_array_append_val (regex->captures, capture);
+    }
+}
+
+static gboolean
+is_capture_key (gpointer key, gpointer value _UNUSED_, gpointer data _UNUSED_)
+{
+    return strncmp (key, "RE:", 3) == 0;
+}
+
+/* sets the value of the captures of the match in ovector (with rc as returned
+ * by pcre2_match) on name as variables, if they're used. Groups not set are
+ * empty, and those of previous rules are dropped */
+static void
+set_capture_values (regex_t     *regex,
+                    const gchar *name,
+                    PCRE2_SIZE  *ovector,
+                    gint         rc)
+{
+    GHashTable    *var_per_file;
+    capture_var_t *capture;
+    PCRE2_SIZE     start;
+    guint          i;
+    
+    if (!(var_per_file = get_var_per_file ()))
+    {
+        return;
+    }
+    
+    g_hash_table_foreach_remove (var_per_file, is_capture_key, NULL);
+    for (i = 0; i < regex->captures->len; ++i)
+    {
+        capture = &g_array_index (regex->captures, capture_var_t, i);
+        start = ovector[2 * capture->group];
+        g_hash_table_replace (var_per_file, g_strdup (capture->key),
+                (capture->group >= (uint32_t) rc || start == PCRE2_UNSET)
+                ? g_strdup ("")
+                : g_strndup (name + start,
+                             ovector[2 * capture->group + 1] - start));
+    }
+}
 
 gboolean
-rule_sr_init (gpointer  *data,
-              GPtrArray *params,
-              GError   **error)
+rule_regex_init (gpointer  *data,
+                 GPtrArray *params,
+                 GError   **error)
 {
-    sr_t *d;
-    gchar *options;
+    pcre2_compile_context *context;
+    const gchar           *pattern;
+    const gchar           *replacement;
+    const gchar           *options;
+    PCRE2_UCHAR            message[256];
+    PCRE2_SIZE             offset;
+    uint32_t               flags;
+    uint32_t               nb;
+    gint                   err;
+    regex_t               *d;
     
-    /* make sure we have something to search for */
+    /* make sure we have a pattern */
     if (!params || params->len < 1)
     {
         g_set_error (error, MOLT_RULE_ERROR, 1,
-                     "Parameter(s) missing");
+                     "Pattern missing");
         return FALSE;
     }
-    /* and not too many params */
     else if (params->len > 3)
     {
         g_set_error (error, MOLT_RULE_ERROR, 1,
-                     "Too many parameters; syntax: search[/replace[/options]]");
+                     "Too many parameters");
         return FALSE;
     }
     
-    *data = g_malloc0 (sizeof (*d));
-    d = *data;
-    
-    d->search = g_ptr_array_index (params, 0);
-    d->len_search = strlen (d->search);
+    pattern = g_ptr_array_index (params, 0);
     if (params->len >= 2)
     {
-        d->replace = g_ptr_array_index (params, 1);
-        d->len_replace = strlen (d->replace);
+        replacement = g_ptr_array_index (params, 1);
+    }
+    else
+    {
+        replacement = "";
     }
     
+    /* same defaults as GRegex */
+    flags = PCRE2_UTF | PCRE2_UCP;
     if (params->len == 3)
     {
         options = g_ptr_array_index (params, 2);
+        if (options && strcmp (options, "i") == 0)
+        {
+            flags |= PCRE2_CASELESS;
+        }
     }
-    if (!options || strcmp (options, "i") != 0)
+    
+    d = g_malloc0 (sizeof (*d));
+    context = pcre2_compile_context_create (NULL);
+    pcre2_set_newline (context, PCRE2_NEWLINE_ANY);
+    d->code = pcre2_compile ((PCRE2_SPTR) pattern, PCRE2_ZERO_TERMINATED, flags,
+                             &err, &offset, context);
+    pcre2_compile_context_free (context);
+    if (!d->code)
     {
-        d->strstr = strstr;
+        pcre2_get_error_message (err, message, sizeof (message));
+        g_set_error (error, MOLT_RULE_ERROR, 1,
+                     "Unable to compile regex: %s at char %lu",
+                     (gchar *) message, (gulong) offset);
+        g_free (d);
+        return FALSE;
     }
-    else
+    /* if not supported, pcre2_match() simply uses the interpreter */
+    pcre2_jit_compile (d->code, PCRE2_JIT_COMPLETE);
+    
+    if (!parse_replacement (d, replacement, error))
+    {
+        regex_free (d);
+        return FALSE;
+    }
+    
+    pcre2_pattern_info (d->code, PCRE2_INFO_CAPTURECOUNT, &nb);
+    if (nb + 1 > regex_ovector_size)
     {
-        d->strstr = strcasestr;
+        regex_ovector_size = nb + 1;
     }
+    set_capture_vars (d, nb);
     
+    *data = d;
     return TRUE;
 }
 
 void
-rule_sr_destroy (gpointer *data)
+rule_regex_destroy (gpointer *data)
 {
-    g_free (*data);
+    regex_free (*data);
+    /* only other threads free theirs on exit */
+    g_private_replace (&regex_match_data, NULL);
 }
 
-gboolean
-rule_sr (gpointer    *_data,
-         gchar       *name,
-		 gchar      **new_name,
-		 GError     **error _UNUSED_)
-{
-    sr_t        *data = *_data;
-    size_t       len_org;
-    size_t       nb;
-    gchar       *s;
-    gchar       *ss;
-    GPtrArray   *sub;
-    size_t       i;
-    
-    len_org = strlen (name);
-    /* this will hold pointers to the different parts in name */
-    sub = g_ptr_array_new ();
-    nb = 0;
-    s = name;
-    while ((s = data->strstr (s, data->search)))
-    {
-        /* found it */
-        ++nb;
-        /* make the string ends here, so we can easily add that part */
-        *s = '\0';
-        /* move right after the searched for part */
-        s += data->len_search;
-        /* and store that location */
-        g_ptr_array_add (sub, (gpointer) s);
-    }
+static void
+append_change_case (molt_buf_t    *buf,
+                    const gchar   *s,
+                    gsize          len,
+                    change_case_t *change_case)
+{
+    const gchar *next;
+    gchar        c[8];
+    gchar       *str;
+    gunichar     u;
     
-    /* did we find anything? */
-    if (nb == 0)
+    if (len == 0)
     {
-        *new_name = NULL;
-        g_ptr_array_free (sub, TRUE);
-        return TRUE;
+        return;
     }
     
-    /* alloc memory for the new name:
-     * - size of original, minus what we're replacing (searched for)
-     * - adding size of replacement(s)
-     * - and 1 for NULL */
-    *new_name = g_malloc0 (
-        (len_org - (nb * data->len_search) + (nb * data->len_replace) + 1)
-        * sizeof (**new_name));
-    
-    /* put what was before the first match */
-    s = g_stpcpy (*new_name, name);
-    /* then add everything */
-    for (i = 0; i < nb; ++i)
+    if (*change_case == CHANGE_CASE_UPPER_SINGLE
+            || *change_case == CHANGE_CASE_LOWER_SINGLE)
     {
-        /* if we have a replacement, add it */
-        if (data->replace)
-        {
-            s = g_stpcpy (s, data->replace);
-        }
-        /* get pointer to the part that came after */
-        ss = g_ptr_array_index (sub, i);
-        /* and add it */
-        s = g_stpcpy (s, ss);
-        /* now move back & restore things */
-        ss -= data->len_search;
-        *ss = data->search[0];
+        u = g_utf8_get_char (s);
+        u = (*change_case == CHANGE_CASE_UPPER_SINGLE)
+            ? g_unichar_toupper (u) : g_unichar_tolower (u);
+        buffer_append (buf, c, (gsize) g_unichar_to_utf8 (u, c));
+        next = g_utf8_next_char (s);
+        len -= (gsize) (next - s);
+        s = next;
+        *change_case = CHANGE_CASE_NONE;
     }
-    g_ptr_array_free (sub, TRUE);
     
-    return TRUE;
+    if (*change_case == CHANGE_CASE_NONE)
+    {
+        buffer_append (buf, s, len);
+        return;
+    }
+    str = (*change_case == CHANGE_CASE_UPPER)
+        ? g_utf8_strup (s, (gssize) len) : g_utf8_strdown (s, (gssize) len);
+    buffer_append (buf, str, strlen (str));
+    g_free (str);
 }
 
-gboolean
-rule_list_init (gpointer  *data,
-                GPtrArray *params _UNUSED_,
-                GError   **error)
+/* appends the replacement for the match of regex in name */
+static void
+expand_replacement (molt_buf_t  *buf,
+                    regex_t     *regex,
+                    const gchar *name,
+                    PCRE2_SIZE  *ovector,
+                    gint         rc)
 {
-    GError *local_err = NULL;
+    change_case_t  change_case = CHANGE_CASE_NONE;
+    repl_t        *repl;
+    gchar          c;
+    guint          i;
     
-    if (G_UNLIKELY (!get_stdin (data, &local_err)))
+    for (i = 0; i < regex->replacement->len; ++i)
     {
-        g_set_error (error, MOLT_RULE_ERROR, 1, "Unable to get stdin: %s",
-                     local_err->message);
-        g_clear_error (&local_err);
-        return FALSE;
+        repl = &g_array_index (regex->replacement, repl_t, i);
+        switch (repl->type)
+        {
+            case REPL_STRING:
+                append_change_case (buf, repl->text, repl->len,
+                                    &change_case);
+                break;
+            case REPL_CHARACTER:
+                c = (gchar) repl->value;
+                buffer_append (buf, &c, 1);
+                break;
+            case REPL_REFERENCE:
+                /* groups that didn't match, or don't exist, are empty */
+                if (repl->value >= 0 && repl->value < rc
+                        && ovector[2 * repl->value] != PCRE2_UNSET)
+                {
+                    append_change_case (buf,
+                            name + ovector[2 * repl->value],
+                            ovector[2 * repl->value + 1]
+                            - ovector[2 * repl->value],
+                            &change_case);
+                }
+                break;
+            case REPL_CHANGE_CASE:
+                change_case = (change_case_t) repl->value;
+                break;
+        }
     }
-    
-    return TRUE;
 }
 
-gboolean
-rule_list (gpointer    *data,
-           const gchar *name _UNUSED_,
-           gchar      **new_name,
-           GError     **error _UNUSED_)
+rule_result_t
+rule_regex (gpointer    *data,
+            const gchar *name,
+            gsize        len,
+            molt_buf_t  *out,
+            GError     **error)
 {
-    FILE *stream = *data;
-    char  buf[PATH_MAX];
-    char *s;
+    regex_t          *regex = *data;
+    pcre2_match_data *match_data;
+    PCRE2_SIZE       *ovector;
+    PCRE2_SIZE        pos = 0;      /* where to search from */
+    PCRE2_SIZE        done = 0;     /* what was copied over */
+    PCRE2_SIZE        start = PCRE2_UNSET;
+    PCRE2_SIZE        end = PCRE2_UNSET;
+    PCRE2_UCHAR       message[256];
+    uint32_t          options = 0;
+    gint              rc;
     
-    if (!fgets ((char *)&buf, PATH_MAX, stream))
-    {
-        /* success w/out a name, so if there are more files than names on the
-         * list given on stdin, we just don't rename the last files (at least,
-         * not by this rule anyways) */
-        *new_name = NULL;
-        return TRUE;
-    }
+    match_data = regex_get_match_data ();
+    ovector = pcre2_get_ovector_pointer (match_data);
     
-    /* because when reading from stdin, there's a newline at the end that we
-     * don't want in the file name
-     * (yeah, if someone wanted to use a LF in their file name that wouldn't
-     * be possible using this rule. also, it would probably be a bad idea...) */
-    for (s = buf; *s != '\0'; ++s)
+    /* same as g_regex_replace() */
+    while (pos <= len)
     {
-        if (*s == '\n')
+        rc = pcre2_match (regex->code, (PCRE2_SPTR) name, len, pos, options,
+                          match_data, NULL);
+        if (rc == PCRE2_ERROR_NOMATCH)
         {
-            *s = '\0';
             break;
         }
+        else if (rc < 0)
+        {
+            pcre2_get_error_message (rc, message, sizeof (message));
+            g_set_error (error, MOLT_RULE_ERROR, 1,
+                         "Failed to process regex: %s", (gchar *) message);
+            return RULE_RESULT_ERROR;
+        }
+        /* name was validated as UTF-8 on the first call */
+        options = PCRE2_NO_UTF_CHECK;
+        
+        /* after an empty match, move on to the next char not to loop */
+        if (ovector[1] == pos)
+        {
+            pos += (pos < len)
+                ? (PCRE2_SIZE) g_utf8_skip[(guchar) name[pos]] : 1;
+        }
+        else
+        {
+            pos = ovector[1];
+        }
+        /* the same (empty) match can then be found again */
+        if (ovector[0] == start && ovector[1] == end)
+        {
+            continue;
+        }
+        if (start == PCRE2_UNSET)
+        {
+            set_capture_values (regex, name, ovector, rc);
+        }
+        start = ovector[0];
+        end = ovector[1];
+        
+        buffer_append (out, name + done, start - done);
+        expand_replacement (out, regex, name, ovector, rc);
+        done = end;
     }
     
-    *new_name = strdup (buf);
-    return TRUE;
+    if (start == PCRE2_UNSET)
+    {
+        return RULE_RESULT_UNCHANGED;
+    }
+    buffer_append (out, name + done, len - done);
+    return RULE_RESULT_CHANGED;
 }
 
+
+/* guards: cheap predicates on the name, the group of rules after one (up to
+ * its matching endif) being skipped for names it doesn't match. Guards don't
+ * change names, molt checks them itself using rule_guard_match() */
+typedef enum {
+    GUARD_GLOB = 0,
+    GUARD_HAS,
+    GUARD_EXT
+} guard_type_t;
+
 typedef struct {
-    GRegex      *regex;
-    const gchar *replacement;
-} regex_t;
+    guard_type_t  type;
+    pcre2_code   *code;     /* GLOB: converted into a regex */
+    sr_t         *sr;       /* HAS: same finder as for sr */
+    GHashTable   *exts;     /* EXT: set of extensions, lowercase if caseless */
+    gsize         max_len;  /* EXT: length of the longest one */
+    gboolean      caseless; /* EXT */
+} guard_t;
 
-gboolean
-rule_regex_init (gpointer  *data,
-                 GPtrArray *params,
-                 GError   **error)
+/* checks params are value[/option], returning whether option i was set */
+static gboolean
+guard_get_params (GPtrArray   *params,
+                  const gchar *syntax,
+                  gboolean    *caseless,
+                  GError     **error)
 {
-    GError              *local_err = NULL;
-    const gchar         *pattern;
-    const gchar         *replacement;
-    const gchar         *options;
-    GRegexCompileFlags   flags;
-    GRegex              *regex;
-    regex_t             *d;
-    
-    /* make sure we have a pattern */
-    if (!params || params->len < 1)
+    if (!params || params->len < 1
+            || *((gchar *) g_ptr_array_index (params, 0)) == '\0')
     {
         g_set_error (error, MOLT_RULE_ERROR, 1,
-                     "Pattern missing");
+                     "Parameter missing; syntax: %s", syntax);
         return FALSE;
     }
-    else if (params->len > 3)
+    else if (params->len > 2)
     {
         g_set_error (error, MOLT_RULE_ERROR, 1,
-                     "Too many parameters");
+                     "Too many parameters; syntax: %s", syntax);
         return FALSE;
     }
-    
-    pattern = g_ptr_array_index (params, 0);
-    if (params->len >= 2)
-    {
-        replacement = g_ptr_array_index (params, 1);
-    }
-    else
+    else if (params->len == 2
+            && strcmp (g_ptr_array_index (params, 1), "i") != 0)
     {
-        replacement = "";
+        g_set_error (error, MOLT_RULE_ERROR, 1,
+                     "Unknown option: %s; syntax: %s",
+                     (gchar *) g_ptr_array_index (params, 1), syntax);
+        return FALSE;
     }
     
-    flags = G_REGEX_OPTIMIZE;
-    if (params->len == 3)
+    *caseless = params->len == 2;
+    return TRUE;
+}
+
+gboolean
+rule_if_glob_init (gpointer  *data,
+                   GPtrArray *params,
+                   GError   **error)
+{
+    const gchar *pattern;
+    PCRE2_UCHAR *converted = NULL;
+    PCRE2_UCHAR  message[256];
+    PCRE2_SIZE   len;
+    PCRE2_SIZE   offset;
+    uint32_t     flags;
+    gboolean     caseless;
+    gint         err;
+    guard_t     *d;
+    
+    if (!guard_get_params (params, "glob[/option]", &caseless, error))
     {
-        options = g_ptr_array_index (params, 2);
-        if (options && strcmp (options, "i") == 0)
-        {
-            flags |= G_REGEX_CASELESS;
-        }
+        return FALSE;
     }
     
-    regex = g_regex_new (pattern, flags, 0, &local_err);
-    if (local_err)
+    pattern = g_ptr_array_index (params, 0);
+    err = pcre2_pattern_convert ((PCRE2_SPTR) pattern, PCRE2_ZERO_TERMINATED,
+                                 PCRE2_CONVERT_GLOB | PCRE2_CONVERT_UTF,
+                                 &converted, &len, NULL);
+    if (err != 0)
     {
+        pcre2_get_error_message (err, message, sizeof (message));
         g_set_error (error, MOLT_RULE_ERROR, 1,
-                     "Unable to compile regex: %s", local_err->message);
-        g_clear_error (&local_err);
+                     "Invalid glob: %s", (gchar *) message);
         return FALSE;
     }
     
-    if (!g_regex_check_replacement (replacement, NULL, &local_err))
+    /* invalid UTF-8 in names simply doesn't match */
+    flags = PCRE2_UTF | PCRE2_UCP | PCRE2_MATCH_INVALID_UTF;
+    if (caseless)
+    {
+        flags |= PCRE2_CASELESS;
+    }
+    d = g_malloc0 (sizeof (*d));
+    d->type = GUARD_GLOB;
+    d->code = pcre2_compile (converted, len, flags, &err, &offset, NULL);
+    pcre2_converted_pattern_free (converted);
+    if (!d->code)
     {
+        pcre2_get_error_message (err, message, sizeof (message));
         g_set_error (error, MOLT_RULE_ERROR, 1,
-                     "Invalid replacement: %s", local_err->message);
-        g_clear_error (&local_err);
-        g_regex_unref (regex);
+                     "Unable to compile glob: %s", (gchar *) message);
+        g_free (d);
         return FALSE;
     }
+    pcre2_jit_compile (d->code, PCRE2_JIT_COMPLETE);
     
-    *data = g_malloc0 (sizeof (*d));
-    d = *data;
-    d->regex = regex;
-    d->replacement = replacement;
-    
+    *data = d;
     return TRUE;
 }
 
-void
-rule_regex_destroy (gpointer *data)
+gboolean
+rule_if_has_init (gpointer  *data,
+                  GPtrArray *params,
+                  GError   **error)
 {
-    g_regex_unref (((regex_t *)*data)->regex);
-    g_free (*data);
+    gboolean  caseless;
+    guard_t  *d;
+    
+    if (!guard_get_params (params, "string[/option]", &caseless, error))
+    {
+        return FALSE;
+    }
+    
+    d = g_malloc0 (sizeof (*d));
+    d->type = GUARD_HAS;
+    d->sr = g_malloc0 (sizeof (*d->sr));
+    d->sr->search = g_ptr_array_index (params, 0);
+    d->sr->len_search = strlen (d->sr->search);
+    sr_set_needle (d->sr, caseless);
+    
+    *data = d;
+    return TRUE;
 }
 
 gboolean
-rule_regex (gpointer    *data,
-            const gchar *name,
-            gchar      **new_name,
-            GError     **error)
+rule_if_ext_init (gpointer  *data,
+                  GPtrArray *params,
+                  GError   **error)
 {
-    GError *local_err = NULL;
-    regex_t *regex = *data;
+    gchar    **exts;
+    gchar    **ext;
+    gchar     *s;
+    gboolean   caseless;
+    guard_t   *d;
+    
+    if (!guard_get_params (params, "ext[,ext...][/option]", &caseless, error))
+    {
+        return FALSE;
+    }
+    
+    d = g_malloc0 (sizeof (*d));
+    d->type = GUARD_EXT;
+    d->caseless = caseless;
+    d->exts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                     (GDestroyNotify) g_free, NULL);
+    exts = g_strsplit (g_ptr_array_index (params, 0), ",", -1);
+    for (ext = exts; *ext; ++ext)
+    {
+        /* ".jpg" is the same as "jpg" */
+        s = (**ext == '.') ? *ext + 1 : *ext;
+        if (*s == '\0')
+        {
+            continue;
+        }
+        s = (caseless) ? g_ascii_strdown (s, -1) : g_strdup (s);
+        d->max_len = MAX (d->max_len, strlen (s));
+        g_hash_table_add (d->exts, s);
+    }
+    g_strfreev (exts);
     
-    *new_name = g_regex_replace (regex->regex, name, -1, 0, regex->replacement,
-                                 0, &local_err);
-    if (local_err)
+    if (g_hash_table_size (d->exts) == 0)
     {
         g_set_error (error, MOLT_RULE_ERROR, 1,
-                     "Failed to process regex: %s", local_err->message);
-        g_clear_error (&local_err);
+                     "No extension specified");
+        rule_guard_destroy ((gpointer *) &d);
         return FALSE;
     }
     
+    *data = d;
     return TRUE;
 }
 
+void
+rule_guard_destroy (gpointer *data)
+{
+    guard_t *guard = *data;
+    
+    if (guard->code)
+    {
+        pcre2_code_free (guard->code);
+        /* only other threads free theirs on exit */
+        g_private_replace (&regex_match_data, NULL);
+    }
+    if (guard->sr)
+    {
+        rule_sr_destroy ((gpointer *) &guard->sr);
+    }
+    if (guard->exts)
+    {
+        g_hash_table_destroy (guard->exts);
+    }
+    g_free (guard);
+}
+
+/* whether name (of length len) has an extension in the set of guard */
+static gboolean
+guard_match_ext (guard_t *guard, const gchar *name, gsize len)
+{
+    const gchar *end = name + len;
+    const gchar *s;
+    gchar        ext[256];
+    gsize        i;
+    
+    /* extension is after the last dot, unless it starts the name (e.g. a
+     * hidden file) */
+    for (s = end; s > name && s[-1] != '.' && s[-1] != '/'; --s)
+    {
+    }
+    if (s - 1 <= name || s[-1] != '.' || s[-2] == '/'
+            || (gsize) (end - s) > guard->max_len
+            || (gsize) (end - s) >= sizeof (ext))
+    {
+        return FALSE;
+    }
+    
+    for (i = 0; s < end; ++s, ++i)
+    {
+        ext[i] = (guard->caseless) ? g_ascii_tolower (*s) : *s;
+    }
+    ext[i] = '\0';
+    return g_hash_table_contains (guard->exts, ext);
+}
 
+/* whether name (of length len) matches the guard (data, as set on init). If
+ * not, rules up to its endif are to be skipped */
 gboolean
+rule_guard_match (gpointer data, const gchar *name, gsize len)
+{
+    guard_t *guard = data;
+    gsize    len_match;
+    
+    switch (guard->type)
+    {
+        case GUARD_GLOB:
+            return pcre2_match (guard->code, (PCRE2_SPTR) name, len, 0, 0,
+                                regex_get_match_data (), NULL) >= 0;
+        case GUARD_HAS:
+            return guard->sr->find (guard->sr, name, name + len,
+                                    &len_match) != NULL;
+        case GUARD_EXT:
+            return guard_match_ext (guard, name, len);
+    }
+    return FALSE;
+}
+
+rule_result_t
+rule_guard (gpointer    *data _UNUSED_,
+            const gchar *name _UNUSED_,
+            gsize        len _UNUSED_,
+            molt_buf_t  *out _UNUSED_,
+            GError     **error _UNUSED_)
+{
+    /* guards are checked by molt, running one doesn't do anything */
+    return RULE_RESULT_UNCHANGED;
+}
+
+rule_result_t
+rule_endif (gpointer    *data _UNUSED_,
+            const gchar *name _UNUSED_,
+            gsize        len _UNUSED_,
+            molt_buf_t  *out _UNUSED_,
+            GError     **error _UNUSED_)
+{
+    /* only marks the end of the group of the matching guard */
+    return RULE_RESULT_UNCHANGED;
+}
+
+
+rule_result_t
 rule_variables (gpointer    *data _UNUSED_,
                 const gchar *name _UNUSED_,
-                gchar      **new_name _UNUSED_,
+                gsize        len _UNUSED_,
+                molt_buf_t  *out _UNUSED_,
                 GError     **error _UNUSED_)
 {
     /* this rule doesn't actually do anything, it's just a rule with the flag
      * resolve_variables enabled, to do just that. But that is done by molt, and
      * the rule itself doesn't do anything */
-    return TRUE;
+    return RULE_RESULT_UNCHANGED;
 }
 
 
@@ -406,16 +2096,175 @@ rule_tpl_init (gpointer  *data,
         return FALSE;
     }
     
-    *data = g_ptr_array_index (params, 0);
-    return TRUE;
+    /* parsed once, molt then only needs to append values for each file */
+    *data = template_new (g_ptr_array_index (params, 0), error);
+    return *data != NULL;
 }
 
-gboolean
-rule_tpl (gpointer    *data,
+void
+rule_tpl_destroy (gpointer *data)
+{
+    template_free (*data);
+}
+
+rule_result_t
+rule_tpl (gpointer    *data _UNUSED_,
           const gchar *name _UNUSED_,
-          gchar      **new_name,
+          gsize        len _UNUSED_,
+          molt_buf_t  *out _UNUSED_,
           GError     **error _UNUSED_)
 {
-    *new_name = g_strdup (*data);
-    return TRUE;
+    /* as for rule vars, it's molt that resolves variables, here of the
+     * template (data) instead of the name */
+    return RULE_RESULT_UNCHANGED;
+}
+
+/* fused rules: consecutive built-in rules (case conversions & sr) applied
+ * together, ASCII case conversions being done in place.
+ * The result must be exactly the same as applying them one after the other */
+typedef enum {
+    FUSED_LOWER = 0,
+    FUSED_UPPER,
+    FUSED_CAMEL,
+    FUSED_SR
+} fused_op_t;
+
+typedef struct {
+    fused_op_t  op;
+    sr_t       *sr;
+    gboolean    is_ascii;   /* (sr) whether the replacement is plain ASCII */
+} fused_step_t;
+
+/* whether rule (with data, as set on init) can be fused */
+gboolean
+rule_can_fuse (rule_def_t *rule, gpointer data _UNUSED_)
+{
+    return rule->run_buf == rule_to_lower
+        || rule->run_buf == rule_to_upper
+        || rule->run_buf == rule_camel
+        || rule->run_buf == rule_sr;
+}
+
+gpointer
+rule_fused_new (void)
+{
+    return g_array_new (FALSE, FALSE, sizeof (fused_step_t));
+}
+
+/* adds rule (which must be one that can be fused) to fused, which takes
+ * ownership of its data */
+void
+rule_fused_add (gpointer fused, rule_def_t *rule, gpointer data)
+{
+    fused_step_t step = { FUSED_LOWER, NULL, TRUE };
+    
+    if (rule->run_buf == rule_to_upper)
+    {
+        step.op = FUSED_UPPER;
+    }
+    else if (rule->run_buf == rule_camel)
+    {
+        step.op = FUSED_CAMEL;
+    }
+    else if (rule->run_buf == rule_sr)
+    {
+        step.op = FUSED_SR;
+        step.sr = data;
+        step.is_ascii = !step.sr->replace || is_ascii (step.sr->replace);
+    }
+    g_array_append_val ((GArray *) fused, step);
+}
+
+void
+rule_fused_destroy (gpointer *data)
+{
+    GArray *steps = *data;
+    guint   i;
+    
+    for (i = 0; i < steps->len; ++i)
+    {
+        fused_step_t *step = &g_array_index (steps, fused_step_t, i);
+        if (step->sr)
+        {
+            rule_sr_destroy ((gpointer *) &step->sr);
+        }
+    }
+    g_array_free (steps, TRUE);
+}
+
+static void
+fused_scratch_free (molt_buf_t *buf)
+{
+    buffer_free (buf);
+    g_free (buf);
+}
+
+/* buffer of the current thread steps write into, before it's swapped with out
+ * (both are molt's, from the same thread) */
+static GPrivate fused_scratch =
+    G_PRIVATE_INIT ((GDestroyNotify) fused_scratch_free);
+
+rule_result_t
+rule_fused (gpointer    *data,
+            const gchar *name,
+            gsize        len,
+            molt_buf_t  *out,
+            GError     **error _UNUSED_)
+{
+    GArray       *steps = *data;
+    fused_step_t *step;
+    molt_buf_t   *scratch;
+    molt_buf_t    tmp;
+    gboolean      changed;
+    gboolean      ascii;
+    guint         i;
+    
+    scratch = g_private_get (&fused_scratch);
+    if (G_UNLIKELY (!scratch))
+    {
+        scratch = g_new0 (molt_buf_t, 1);
+        g_private_set (&fused_scratch, scratch);
+    }
+    
+    buffer_append (out, name, len);
+    /* for plain ASCII, case conversions are done in place */
+    ascii = is_ascii (name);
+    for (i = 0; i < steps->len; ++i)
+    {
+        step = &g_array_index (steps, fused_step_t, i);
+        scratch->len = 0;
+        changed = FALSE;
+        switch (step->op)
+        {
+            case FUSED_LOWER:
+            case FUSED_UPPER:
+                if (ascii)
+                {
+                    ascii_change_case (out->str, out->str, out->len,
+                                       step->op == FUSED_UPPER);
+                }
+                else
+                {
+                    changed = change_case (scratch, out->str, out->len,
+                                           step->op == FUSED_UPPER);
+                }
+                break;
+            case FUSED_CAMEL:
+                changed = camel_case (scratch, out->str, out->len);
+                break;
+            case FUSED_SR:
+                changed = sr_replace (step->sr, out->str, out->len, scratch);
+                ascii = ascii && (!changed || step->is_ascii);
+                break;
+        }
+        if (changed)
+        {
+            tmp = *out;
+            *out = *scratch;
+            *scratch = tmp;
+        }
+    }
+    
+    return (out->len != len || memcmp (out->str, name, len) != 0)
+        ? RULE_RESULT_CHANGED : RULE_RESULT_UNCHANGED;
 }
@@ -35,22 +35,25 @@ extern "C" {
 
 #define MOLT_RULE_ERROR		g_quark_from_static_string ("molt rule error")
 
-gboolean
+rule_result_t
 rule_to_lower (gpointer    *data,
                const gchar *name,
-               gchar      **new_name,
+               gsize        len,
+               molt_buf_t  *out,
                GError     **error);
 
-gboolean
+rule_result_t
 rule_to_upper (gpointer    *data,
                const gchar *name,
-               gchar      **new_name,
+               gsize        len,
+               molt_buf_t  *out,
                GError     **error);
 
-gboolean
+rule_result_t
 rule_camel (gpointer    *data,
             const gchar *name,
-            gchar      **new_name,
+            gsize        len,
+            molt_buf_t  *out,
             GError     **error);
 
 gboolean
@@ -59,52 +62,131 @@ rule_sr_init (gpointer  *data,
               GError   **error);
 void
 rule_sr_destroy (gpointer *data);
-gboolean
+rule_result_t
 rule_sr (gpointer    *_data,
-         gchar       *name,
-		 gchar      **new_name,
-		 GError     **error);
+         const gchar *name,
+         gsize        len,
+         molt_buf_t  *out,
+         GError     **error);
+
+gboolean
+rule_dict_init (gpointer  *data,
+                GPtrArray *params,
+                GError   **error);
+void
+rule_dict_destroy (gpointer *data);
+rule_result_t
+rule_dict (gpointer    *data,
+           const gchar *name,
+           gsize        len,
+           molt_buf_t  *out,
+           GError     **error);
 
 
 gboolean
 rule_list_init (gpointer  *data,
                 GPtrArray *params,
                 GError   **error);
-gboolean
+void
+rule_list_destroy (gpointer *data);
+rule_result_t
 rule_list (gpointer    *data,
            const gchar *name,
-           gchar      **new_name,
+           gsize        len,
+           molt_buf_t  *out,
            GError     **error);
 
 
+gboolean
+rule_map_init (gpointer  *data,
+               GPtrArray *params,
+               GError   **error);
+void
+rule_map_destroy (gpointer *data);
+rule_result_t
+rule_map (gpointer    *data,
+          const gchar *name,
+          gsize        len,
+          molt_buf_t  *out,
+          GError     **error);
+
 gboolean
 rule_regex_init (gpointer  *_data,
                  GPtrArray *params,
                  GError   **error);
 void
 rule_regex_destroy (gpointer *data);
-gboolean
+rule_result_t
 rule_regex (gpointer    *data,
             const gchar *name,
-            gchar      **new_name,
+            gsize        len,
+            molt_buf_t  *out,
             GError     **error);
 
 gboolean
+rule_if_glob_init (gpointer  *data,
+                   GPtrArray *params,
+                   GError   **error);
+gboolean
+rule_if_has_init (gpointer  *data,
+                  GPtrArray *params,
+                  GError   **error);
+gboolean
+rule_if_ext_init (gpointer  *data,
+                  GPtrArray *params,
+                  GError   **error);
+void
+rule_guard_destroy (gpointer *data);
+gboolean
+rule_guard_match (gpointer data, const gchar *name, gsize len);
+rule_result_t
+rule_guard (gpointer    *data,
+            const gchar *name,
+            gsize        len,
+            molt_buf_t  *out,
+            GError     **error);
+rule_result_t
+rule_endif (gpointer    *data,
+            const gchar *name,
+            gsize        len,
+            molt_buf_t  *out,
+            GError     **error);
+
+rule_result_t
 rule_variables (gpointer    *data,
                 const gchar *name,
-                gchar      **new_name,
+                gsize        len,
+                molt_buf_t  *out,
                 GError     **error);
 
 gboolean
 rule_tpl_init (gpointer  *data,
                GPtrArray *params,
                GError   **error);
-gboolean
+void
+rule_tpl_destroy (gpointer *data);
+rule_result_t
 rule_tpl (gpointer    *data,
           const gchar *name,
-          gchar      **new_name,
+          gsize        len,
+          molt_buf_t  *out,
           GError     **error);
 
+gboolean
+rule_can_fuse (rule_def_t *rule, gpointer data);
+gpointer
+rule_fused_new (void);
+void
+rule_fused_add (gpointer fused, rule_def_t *rule, gpointer data);
+void
+rule_fused_destroy (gpointer *data);
+rule_result_t
+rule_fused (gpointer    *data,
+            const gchar *name,
+            gsize        len,
+            molt_buf_t  *out,
+            GError     **error);
+
 
 #ifdef	__cplusplus
 }
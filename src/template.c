@@ -0,0 +1,543 @@
+/**
+ * molt - Copyright (C) 2012 Olivier Brunel
+ *
+ * template.c
+ * Copyright (C) 2012 Olivier Brunel <i.am.jack.mail@gmail.com>
+ *
+ * This file is part of molt.
+ *
+ * molt is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * molt is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * molt. If not, see http://www.gnu.org/licenses/
+ */
+
+/* C */
+#include <stdlib.h> /* strtol() */
+#include <string.h>
+
+/* molt */
+#include "template.h"
+#include "buffer.h"
+
+typedef enum {
+    FORMAT_UPPER = 0,
+    FORMAT_LOWER,
+    FORMAT_PAD,
+    FORMAT_RPAD,
+    FORMAT_SUB,
+    FORMAT_DEFAULT
+} format_type_t;
+
+/* format applied to the value of a variable, e.g. $NAME|pad:3:0$ */
+typedef struct {
+    format_type_t    type;
+    glong            n;         /* PAD, RPAD: width; SUB: start */
+    glong            len;       /* SUB: nb of chars, -1 for up to the end */
+    gchar           *text;      /* PAD, RPAD: padding char; DEFAULT: value */
+    gsize            len_text;
+} format_t;
+
+/* part of a template: literal text, or a variable (and its formats) */
+typedef struct {
+    gchar           *text;
+    gsize            len;
+    template_var_t  *var;
+    GArray          *formats;   /* format_t, NULL if none */
+} segment_t;
+
+struct _template_t {
+    GArray          *segments;
+};
+
+static void free_format_buffers (molt_buf_t *bufs);
+
+/* formats are applied into each of the pair in turns. Templates can be shared
+ * by threads, so each one has its own */
+static GPrivate format_buffers_key =
+    G_PRIVATE_INIT ((GDestroyNotify) free_format_buffers);
+
+/* whether the char at s is escaped, i.e. preceded (in str) by an odd number
+ * of backslashes */
+static gboolean
+is_escaped (const gchar *str, const gchar *s)
+{
+    gboolean escaped = FALSE;
+    
+    for (--s; s >= str && *s == '\\'; --s)
+    {
+        escaped = !escaped;
+    }
+    return escaped;
+}
+
+/* splits [s, end) on c (unless escaped, the backslash being then removed),
+ * into an array of strings it owns */
+static GPtrArray *
+split_escaped (const gchar *s, const gchar *end, gchar c)
+{
+    GPtrArray   *arr;
+    GString     *str;
+    const gchar *p;
+    
+    arr = g_ptr_array_new_with_free_func (g_free);
+    str = g_string_new (NULL);
+    for (p = s; p < end; ++p)
+    {
+        if (*p == c)
+        {
+            if (!is_escaped (s, p))
+            {
+                g_ptr_array_add (arr, g_string_free (str, FALSE));
+                str = g_string_new (NULL);
+                continue;
+            }
+            g_string_truncate (str, str->len - 1);
+        }
+        g_string_append_c (str, *p);
+    }
+    g_ptr_array_add (arr, g_string_free (str, FALSE));
+    return arr;
+}
+
+static gboolean
+parse_long (const gchar *s, glong *value)
+{
+    gchar *e;
+    
+    *value = strtol (s, &e, 10);
+    return *s != '\0' && *e == '\0';
+}
+
+/* parses spec (e.g. "pad:3:0") into fmt */
+static gboolean
+parse_format (const gchar *spec, format_t *fmt, GError **error)
+{
+    const gchar *args;
+    GPtrArray   *arr = NULL;
+    gsize        len_name;
+    gboolean     ok = TRUE;
+    
+    args = strchr (spec, ':');
+    len_name = (args) ? (gsize) (args - spec) : strlen (spec);
+    if (args)
+    {
+        ++args;
+    }
+    
+#define is_format(name) \
+    (len_name == strlen (name) && strncmp (spec, name, len_name) == 0)
+    
+    memset (fmt, 0, sizeof (*fmt));
+    if (is_format ("upper") || is_format ("lower"))
+    {
+        fmt->type = (*spec == 'u') ? FORMAT_UPPER : FORMAT_LOWER;
+        ok = !args;
+    }
+    else if (is_format ("default"))
+    {
+        /* the value can have colons */
+        fmt->type = FORMAT_DEFAULT;
+        fmt->text = g_strdup ((args) ? args : "");
+        fmt->len_text = strlen (fmt->text);
+    }
+    else if (is_format ("pad") || is_format ("rpad"))
+    {
+        fmt->type = (*spec == 'p') ? FORMAT_PAD : FORMAT_RPAD;
+        arr = (args) ? split_escaped (args, args + strlen (args), ':') : NULL;
+        ok = arr && arr->len <= 2
+            && parse_long (g_ptr_array_index (arr, 0), &fmt->n) && fmt->n > 0;
+        if (ok && arr->len == 2
+                && *((gchar *) g_ptr_array_index (arr, 1)) != '\0')
+        {
+            fmt->text = g_strdup (g_ptr_array_index (arr, 1));
+            ok = g_utf8_validate (fmt->text, -1, NULL)
+                && g_utf8_strlen (fmt->text, -1) == 1;
+        }
+        else
+        {
+            fmt->text = g_strdup (" ");
+        }
+        fmt->len_text = strlen (fmt->text);
+    }
+    else if (is_format ("sub"))
+    {
+        fmt->type = FORMAT_SUB;
+        fmt->len = -1;
+        arr = (args) ? split_escaped (args, args + strlen (args), ':') : NULL;
+        ok = arr && arr->len <= 2
+            && parse_long (g_ptr_array_index (arr, 0), &fmt->n)
+            && (arr->len == 1
+                    || (parse_long (g_ptr_array_index (arr, 1), &fmt->len)
+                        && fmt->len >= 0));
+    }
+    else
+    {
+        g_set_error (error, MOLT_TEMPLATE_ERROR, 1,
+                     "Unknown format: %s", spec);
+        return FALSE;
+    }
+    
+#undef is_format
+    
+    if (arr)
+    {
+        g_ptr_array_free (arr, TRUE);
+    }
+    if (!ok)
+    {
+        g_set_error (error, MOLT_TEMPLATE_ERROR, 1,
+                     "Invalid format: %s", spec);
+        g_free (fmt->text);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+free_segment (segment_t *seg)
+{
+    guint i;
+    
+    g_free (seg->text);
+    if (seg->var)
+    {
+        g_free (seg->var->name);
+        g_free (seg->var->key);
+        if (seg->var->split)
+        {
+            g_ptr_array_free (seg->var->split, TRUE);
+            g_ptr_array_free (seg->var->whole, TRUE);
+        }
+        g_free (seg->var);
+    }
+    if (seg->formats)
+    {
+        for (i = 0; i < seg->formats->len; ++i)
+        {
+            g_free (g_array_index (seg->formats, format_t, i).text);
+        }
+        g_array_free (seg->formats, TRUE);
+    }
+}
+
+static void
+add_literal (template_t *tpl, const gchar *s, const gchar *end)
+{
+    segment_t seg = { NULL, 0, NULL, NULL };
+    
+    if (s < end)
+    {
+        seg.len = (gsize) (end - s);
+        seg.text = g_strndup (s, seg.len);
+        g_array_append_val (tpl->segments, seg);
+    }
+}
+
+/* adds the variable (name, params & formats) in [s, end) */
+static gboolean
+add_variable (template_t   *tpl,
+              const gchar  *s,
+              const gchar  *end,
+              GError      **error)
+{
+    segment_t  seg = { NULL, 0, NULL, NULL };
+    format_t   fmt;
+    GPtrArray *parts;
+    gchar     *spec;
+    gchar     *params;
+    guint      i;
+    
+    parts = split_escaped (s, end, '|');
+    spec = g_ptr_array_index (parts, 0);
+    seg.var = g_new0 (template_var_t, 1);
+    params = strchr (spec, ':');
+    if (params)
+    {
+        seg.var->name = g_strndup (spec, (gsize) (params - spec));
+        ++params;
+    }
+    else
+    {
+        seg.var->name = g_strdup (spec);
+        params = spec + strlen (spec);
+    }
+    seg.var->key = g_strconcat (seg.var->name, ":", params, NULL);
+    if (*params)
+    {
+        seg.var->split = split_escaped (params, params + strlen (params), ':');
+        seg.var->whole = g_ptr_array_new_with_free_func (g_free);
+        g_ptr_array_add (seg.var->whole, g_strdup (params));
+    }
+    
+    for (i = 1; i < parts->len; ++i)
+    {
+        if (!parse_format (g_ptr_array_index (parts, i), &fmt, error))
+        {
+            free_segment (&seg);
+            g_ptr_array_free (parts, TRUE);
+            return FALSE;
+        }
+        if (!seg.formats)
+        {
+            seg.formats = g_array_new (FALSE, FALSE, sizeof (format_t));
+        }
+        g_array_append_val (seg.formats, fmt);
+    }
+    g_ptr_array_free (parts, TRUE);
+    
+    g_array_append_val (tpl->segments, seg);
+    return TRUE;
+}
+
+/* parses str. Variables are between (unescaped) dollar signs, $$ being left
+ * as is */
+template_t *
+template_new (const gchar *str, GError **error)
+{
+    template_t  *tpl;
+    const gchar *s;
+    const gchar *last;
+    const gchar *start = NULL;
+    
+    tpl = g_new0 (template_t, 1);
+    tpl->segments = g_array_new (FALSE, FALSE, sizeof (segment_t));
+    for (s = last = str; *s; ++s)
+    {
+        if (*s != '$' || is_escaped (str, s))
+        {
+            continue;
+        }
+        
+        if (!start)
+        {
+            start = s + 1;
+        }
+        else if (s == start)
+        {
+            start = NULL;
+        }
+        else
+        {
+            add_literal (tpl, last, start - 1);
+            if (!add_variable (tpl, start, s, error))
+            {
+                template_free (tpl);
+                return NULL;
+            }
+            start = NULL;
+            last = s + 1;
+        }
+    }
+    add_literal (tpl, last, s);
+    
+    return tpl;
+}
+
+/* returns the number of chars in s (of length len), or bytes if it isn't valid
+ * UTF-8 */
+static glong
+nb_chars (const gchar *s, gsize len, gboolean utf8)
+{
+    return (utf8) ? g_utf8_strlen (s, (gssize) len) : (glong) len;
+}
+
+/* returns the offset (in bytes) of the n-th char of s */
+static gsize
+char_offset (const gchar *s, glong n, gboolean utf8)
+{
+    return (utf8) ? (gsize) (g_utf8_offset_to_pointer (s, n) - s) : (gsize) n;
+}
+
+static void
+append_case (molt_buf_t  *buf,
+             const gchar *s,
+             gsize        len,
+             gboolean     utf8,
+             gboolean     upper)
+{
+    gchar *str;
+    gchar *p;
+    gsize  i;
+    
+    for (i = 0; i < len && !(s[i] & 0x80); ++i)
+    {
+    }
+    if (utf8 && i < len)
+    {
+        str = (upper) ? g_utf8_strup (s, (gssize) len)
+                      : g_utf8_strdown (s, (gssize) len);
+        buffer_append (buf, str, strlen (str));
+        g_free (str);
+        return;
+    }
+    
+    /* only ASCII letters are converted */
+    p = buffer_reserve (buf, len);
+    for (i = 0; i < len; ++i)
+    {
+        p[i] = (upper) ? g_ascii_toupper (s[i]) : g_ascii_tolower (s[i]);
+    }
+    buf->len += len;
+    buf->str[buf->len] = '\0';
+}
+
+/* applies fmt to value (of length *len), returning the result (its length
+ * put in len), which might be written in buf */
+static const gchar *
+apply_format (format_t     *fmt,
+              const gchar  *value,
+              gsize        *len,
+              molt_buf_t   *buf)
+{
+    gboolean utf8;
+    glong    n;
+    glong    start;
+    glong    count;
+    gsize    from;
+    
+    if (fmt->type == FORMAT_DEFAULT)
+    {
+        if (*len > 0)
+        {
+            return value;
+        }
+        *len = fmt->len_text;
+        return fmt->text;
+    }
+    
+    utf8 = g_utf8_validate (value, (gssize) *len, NULL);
+    switch (fmt->type)
+    {
+        case FORMAT_UPPER:
+        case FORMAT_LOWER:
+            append_case (buf, value, *len, utf8, fmt->type == FORMAT_UPPER);
+            break;
+        case FORMAT_PAD:
+        case FORMAT_RPAD:
+            n = nb_chars (value, *len, utf8);
+            if (n >= fmt->n)
+            {
+                return value;
+            }
+            if (fmt->type == FORMAT_RPAD)
+            {
+                buffer_append (buf, value, *len);
+            }
+            for ( ; n < fmt->n; ++n)
+            {
+                buffer_append (buf, fmt->text, fmt->len_text);
+            }
+            if (fmt->type == FORMAT_PAD)
+            {
+                buffer_append (buf, value, *len);
+            }
+            break;
+        case FORMAT_SUB:
+            n = nb_chars (value, *len, utf8);
+            /* negative start is from the end */
+            start = (fmt->n < 0) ? MAX (n + fmt->n, 0) : MIN (fmt->n, n);
+            count = (fmt->len < 0 || fmt->len > n - start) ? n - start
+                                                           : fmt->len;
+            from = char_offset (value, start, utf8);
+            buffer_append (buf, value + from,
+                           char_offset (value, start + count, utf8) - from);
+            break;
+        case FORMAT_DEFAULT:
+            break;
+    }
+    *len = buf->len;
+    return buf->str;
+}
+
+static void
+free_format_buffers (molt_buf_t *bufs)
+{
+    buffer_free (&bufs[0]);
+    buffer_free (&bufs[1]);
+    g_free (bufs);
+}
+
+static molt_buf_t *
+get_format_buffers (void)
+{
+    molt_buf_t *bufs;
+    
+    bufs = g_private_get (&format_buffers_key);
+    if (G_UNLIKELY (!bufs))
+    {
+        bufs = g_new0 (molt_buf_t, 2);
+        g_private_set (&format_buffers_key, bufs);
+    }
+    return bufs;
+}
+
+/* appends to out tpl with variables resolved, their values being given by
+ * get_value (with data) */
+gboolean
+template_expand (template_t        *tpl,
+                 molt_buf_t        *out,
+                 template_value_fn  get_value,
+                 gpointer           data,
+                 GError           **error)
+{
+    segment_t   *seg;
+    format_t    *fmt;
+    molt_buf_t  *bufs = NULL;
+    molt_buf_t  *buf;
+    const gchar *value;
+    gsize        len;
+    guint        i;
+    guint        j;
+    
+    for (i = 0; i < tpl->segments->len; ++i)
+    {
+        seg = &g_array_index (tpl->segments, segment_t, i);
+        if (!seg->var)
+        {
+            buffer_append (out, seg->text, seg->len);
+            continue;
+        }
+        
+        if (G_UNLIKELY (!(value = get_value (seg->var, data, error))))
+        {
+            return FALSE;
+        }
+        len = strlen (value);
+        for (j = 0; seg->formats && j < seg->formats->len; ++j)
+        {
+            if (!bufs)
+            {
+                bufs = get_format_buffers ();
+            }
+            /* the buffer not holding value */
+            buf = (value == bufs[0].str) ? &bufs[1] : &bufs[0];
+            buf->len = 0;
+            fmt = &g_array_index (seg->formats, format_t, j);
+            value = apply_format (fmt, value, &len, buf);
+        }
+        buffer_append (out, value, len);
+    }
+    return TRUE;
+}
+
+void
+template_free (template_t *tpl)
+{
+    guint i;
+    
+    for (i = 0; i < tpl->segments->len; ++i)
+    {
+        free_segment (&g_array_index (tpl->segments, segment_t, i));
+    }
+    g_array_free (tpl->segments, TRUE);
+    g_free (tpl);
+}
@@ -0,0 +1,74 @@
+/**
+ * molt - Copyright (C) 2012 Olivier Brunel
+ *
+ * template.h
+ * Copyright (C) 2012 Olivier Brunel <i.am.jack.mail@gmail.com>
+ *
+ * This file is part of molt.
+ *
+ * molt is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * molt is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * molt. If not, see http://www.gnu.org/licenses/
+ */
+
+#ifndef TEMPLATE_H
+#define	TEMPLATE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/* glib */
+#include <glib-2.0/glib.h>
+
+/* molt */
+#include "molt.h"
+
+#define MOLT_TEMPLATE_ERROR g_quark_from_static_string ("molt template error")
+
+/* templates: names with variables ($NAME[:params][|format...]$), parsed once
+ * into literals & references to variables, so expanding one for a file only
+ * means appending values */
+typedef struct _template_t template_t;
+
+/* reference to a variable in a template */
+typedef struct {
+    gchar       *name;
+    gchar       *key;       /* name:params, as in the caches of values */
+    GPtrArray   *split;     /* params split on colons (NULL if none) */
+    GPtrArray   *whole;     /* params as a single one (NULL if none) */
+} template_var_t;
+
+/* function called to get the value of var, when expanding a template. The
+ * value isn't freed */
+typedef const gchar * (*template_value_fn) (template_var_t *var,
+                                            gpointer        data,
+                                            GError        **error);
+
+template_t *
+template_new (const gchar *str, GError **error);
+
+gboolean
+template_expand (template_t        *tpl,
+                 molt_buf_t        *out,
+                 template_value_fn  get_value,
+                 gpointer           data,
+                 GError           **error);
+
+void
+template_free (template_t *tpl);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* TEMPLATE_H */
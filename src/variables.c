@@ -24,6 +24,7 @@
 
 /* C */
 #include <stdlib.h> /* atoi() */
+#include <string.h>
 
 /* glib */
 #include <glib-2.0/glib.h>
@@ -35,7 +36,7 @@
 gchar *
 var_get_value_nb (const gchar *file, GPtrArray *params, GError **error _UNUSED_)
 {
-    static const gchar *last_file   = NULL;
+    static gchar       *last_file   = NULL;
     static guint        cnt         = 0;
     guint               digits      = 0;
     guint               start       = 1;
@@ -68,13 +69,15 @@ var_get_value_nb (const gchar *file, GPtrArray *params, GError **error _UNUSED_)
     /* is this the first file? */
     if (last_file == NULL)
     {
-        last_file = file;
+        last_file = g_strdup (file);
         cnt = start;
     }
-    /* if it's a new file, we increment the counter */
-    else if (last_file != file)
+    /* if it's a new file, we increment the counter. (file is freed once we
+     * return, so its address could well be reused for the next one) */
+    else if (strcmp (last_file, file) != 0)
     {
-        last_file = file;
+        g_free (last_file);
+        last_file = g_strdup (file);
         cnt += incr;
     }
     
@@ -87,3 +90,19 @@ var_get_value_nb (const gchar *file, GPtrArray *params, GError **error _UNUSED_)
         return g_strdup_printf ("%u", cnt);
     }
 }
+
+gchar *
+var_get_value_re (const gchar *file _UNUSED_,
+                  GPtrArray   *params,
+                  GError     **error)
+{
+    /* values are set by rule regex when it matches, so without one the group
+     * is empty */
+    if (!params || params->len < 1)
+    {
+        g_set_error (error, MOLT_VARIABLE_ERROR, 1,
+                     "Capture group missing, e.g. $RE:1$");
+        return NULL;
+    }
+    return g_strdup ("");
+}
@@ -27,9 +27,14 @@
 extern "C" {
 #endif
 
+#define MOLT_VARIABLE_ERROR g_quark_from_static_string ("molt variable error")
+
 gchar *
 var_get_value_nb (const gchar *file, GPtrArray *params, GError **error);
 
+gchar *
+var_get_value_re (const gchar *file, GPtrArray *params, GError **error);
+
 
 #ifdef	__cplusplus
 }
@@ -0,0 +1,638 @@
+/**
+ * molt - Copyright (C) 2012 Olivier Brunel
+ *
+ * walk.c
+ * Copyright (C) 2012 Olivier Brunel <i.am.jack.mail@gmail.com>
+ *
+ * This file is part of molt.
+ *
+ * molt is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * molt is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * molt. If not, see http://www.gnu.org/licenses/
+ */
+
+#define _GNU_SOURCE     /* for openat(), syscall() & DT_* */
+
+/* C */
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+/* molt */
+#include "walk.h"
+
+/* what getdents64 fills the buffer with */
+struct linux_dirent64 {
+    guint64         d_ino;
+    gint64          d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+};
+
+#define DENTS_BUF_SIZE      32768
+/* max number of directories read by threads but not yet sent (each keeping
+ * its fd open until then), unless the limit of open files is lower */
+#define MAX_PENDING         4096
+
+/* entries of a directory are stored one after the other in a buffer, each
+ * being the type (one byte) followed by the NULL-terminated name */
+typedef struct {
+    gchar  *data;
+    size_t  len;
+    size_t  alloc;
+} entries_t;
+
+static GFileTest
+get_type (unsigned char d_type)
+{
+    switch (d_type)
+    {
+        case DT_REG:
+            return G_FILE_TEST_IS_REGULAR;
+        case DT_DIR:
+            return G_FILE_TEST_IS_DIR;
+        case DT_LNK:
+            return G_FILE_TEST_IS_SYMLINK;
+        case DT_UNKNOWN:
+            return 0;
+        default:
+            return G_FILE_TEST_EXISTS;
+    }
+}
+
+/* returns the type of file (as for walk_entry_fn) from its st_mode */
+GFileTest
+get_file_type (mode_t mode)
+{
+    if (S_ISREG (mode))
+    {
+        return G_FILE_TEST_IS_REGULAR;
+    }
+    else if (S_ISDIR (mode))
+    {
+        return G_FILE_TEST_IS_DIR;
+    }
+    else if (S_ISLNK (mode))
+    {
+        return G_FILE_TEST_IS_SYMLINK;
+    }
+    else
+    {
+        return G_FILE_TEST_EXISTS;
+    }
+}
+
+static void
+add_entry (entries_t *entries, GFileTest type, const gchar *name)
+{
+    size_t len = strlen (name) + 1;
+    
+    if (entries->len + len + 1 > entries->alloc)
+    {
+        entries->alloc = (entries->alloc + len + 1) * 2;
+        entries->data = g_realloc (entries->data, entries->alloc);
+    }
+    entries->data[entries->len++] = (gchar) type;
+    memcpy (entries->data + entries->len, name, len);
+    entries->len += len;
+}
+
+static gboolean
+read_entries (gint fd, entries_t *entries, gchar *buf, GError **error)
+{
+    struct linux_dirent64 *d;
+    long nread;
+    long pos;
+    
+    for (;;)
+    {
+        nread = syscall (SYS_getdents64, fd, buf, DENTS_BUF_SIZE);
+        if (nread == 0)
+        {
+            return TRUE;
+        }
+        else if (nread < 0)
+        {
+            g_set_error (error, MOLT_WALK_ERROR, errno, "%s", strerror (errno));
+            return FALSE;
+        }
+    
+        for (pos = 0; pos < nread; pos += d->d_reclen)
+        {
+            d = (struct linux_dirent64 *) (gpointer) (buf + pos);
+            /* skip . and .. */
+            if (d->d_name[0] == '.' && (d->d_name[1] == '\0'
+                        || (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+            {
+                continue;
+            }
+            add_entry (entries, get_type (d->d_type), d->d_name);
+        }
+    }
+}
+
+static void
+walk_dir (walk_t *walk, gint fd, GString *path, gint depth, gchar *buf)
+{
+    GError      *local_err = NULL;
+    entries_t    entries = { NULL, 0, 0 };
+    gchar       *s;
+    const gchar *name;
+    GFileTest    type;
+    gsize        len;
+    gint         sub;
+    struct stat  st;
+    
+    if (!read_entries (fd, &entries, buf, &local_err))
+    {
+        walk->error (path->str, local_err->message, walk->data);
+        g_clear_error (&local_err);
+        g_free (entries.data);
+        return;
+    }
+    
+    len = path->len;
+    /* first we go through subdirectories, so everything inside a directory is
+     * processed before the directory itself (which might get renamed) */
+    for (s = entries.data; s < entries.data + entries.len; s += strlen (s) + 1)
+    {
+        type = (GFileTest) *s++;
+        name = s;
+    
+        /* file system didn't give us the type, we need to stat */
+        if (type == 0)
+        {
+            if (fstatat (fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            {
+                type = get_file_type (st.st_mode);
+                /* remember it for when we process the entries */
+                *(s - 1) = (gchar) type;
+            }
+        }
+    
+        if (type != G_FILE_TEST_IS_DIR
+                || (walk->max_depth >= 0 && depth >= walk->max_depth))
+        {
+            continue;
+        }
+    
+        g_string_append_c (path, '/');
+        g_string_append (path, name);
+        sub = openat (fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (sub < 0)
+        {
+            walk->error (path->str, strerror (errno), walk->data);
+        }
+        else
+        {
+            walk_dir (walk, sub, path, depth + 1, buf);
+            close (sub);
+        }
+        g_string_truncate (path, len);
+    }
+    
+    /* then all the entries of this directory */
+    for (s = entries.data; s < entries.data + entries.len; s += strlen (s) + 1)
+    {
+        type = (GFileTest) *s++;
+        if (walk->filter && !filter_match (walk->filter, s))
+        {
+            continue;
+        }
+        g_string_append_c (path, '/');
+        g_string_append (path, s);
+        walk->entry (fd, path->str, path->str + len + 1, type, NULL, walk->data);
+        g_string_truncate (path, len);
+    }
+    
+    g_free (entries.data);
+}
+
+/* parallel walk: directories are read (and their entries stat'ed) by threads,
+ * each having its own deque of directories to read, stealing from the others
+ * when it runs out. Entries are sent by the calling thread only, in the same
+ * order as for a serial walk. */
+
+typedef enum {
+    NODE_NEW = 0,   /* in a deque, waiting to be read */
+    NODE_BUSY,      /* being read */
+    NODE_READ,      /* read, ready to be sent */
+} node_state_t;
+
+typedef struct {
+    GFileTest    type;
+    gboolean     skip;      /* filtered out, not to be sent */
+    gboolean     has_st;
+    struct stat  st;
+} entry_info_t;
+
+typedef struct _node_t node_t;
+struct _node_t {
+    gchar        *path;
+    const gchar  *name;     /* in path */
+    node_t       *parent;   /* NULL for the root */
+    gint          fd;       /* open from read until sent; the root's isn't ours */
+    gint          depth;
+    node_state_t  state;
+    guint         deque;    /* index of the deque it was pushed onto */
+    GList         link;     /* in said deque, so it's removed in O(1) */
+    gchar        *error;
+    entries_t     entries;
+    entry_info_t *infos;
+    node_t      **subdirs;  /* in the same order as entries */
+    guint         nb_subdirs;
+};
+
+typedef struct {
+    walk_t      *walk;
+    /* everything below is protected by mutex */
+    GMutex       mutex;
+    GCond        cond;
+    GQueue      *deques;    /* one per thread, plus one for the caller */
+    guint        nb_threads;
+    guint        queued;    /* nodes NODE_NEW */
+    guint        pending;   /* nodes claimed but not yet sent */
+    guint        max_pending;
+    gboolean     done;
+} pool_t;
+
+static node_t *
+node_new (const gchar *path, node_t *parent)
+{
+    node_t *node;
+    
+    node = g_slice_new0 (node_t);
+    node->path = g_strdup (path);
+    node->name = (parent) ? node->path + strlen (parent->path) + 1
+                          : node->path;
+    node->parent = parent;
+    node->fd = -1;
+    node->depth = (parent) ? parent->depth + 1 : 1;
+    node->link.data = node;
+    return node;
+}
+
+static void
+node_free (node_t *node)
+{
+    if (node->parent && node->fd >= 0)
+    {
+        close (node->fd);
+    }
+    g_free (node->path);
+    g_free (node->error);
+    g_free (node->entries.data);
+    g_free (node->infos);
+    g_free (node->subdirs);
+    g_slice_free (node_t, node);
+}
+
+/* reads directory of node, stat-ing all entries. Called without the lock */
+static void
+read_node (pool_t *pool, node_t *node, guint deque, gchar *buf)
+{
+    GError      *local_err = NULL;
+    GString     *path;
+    gchar       *s;
+    guint        nb;
+    guint        i;
+    gint         fd;
+    
+    /* relative to the parent, as for a serial walk: it is only sent (and its
+     * fd closed) after all its subdirectories */
+    if (node->parent)
+    {
+        node->fd = openat (node->parent->fd, node->name,
+                           O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (node->fd < 0)
+        {
+            node->error = g_strdup (strerror (errno));
+            return;
+        }
+    }
+    fd = node->fd;
+    
+    if (!read_entries (fd, &node->entries, buf, &local_err))
+    {
+        node->error = g_strdup (local_err->message);
+        g_clear_error (&local_err);
+        return;
+    }
+    
+    for (nb = 0, s = node->entries.data;
+            s < node->entries.data + node->entries.len;
+            s += strlen (s + 1) + 2)
+    {
+        ++nb;
+    }
+    node->infos = g_new (entry_info_t, nb);
+    node->subdirs = g_new (node_t *, nb);
+    
+    path = g_string_new (node->path);
+    for (i = 0, s = node->entries.data;
+            s < node->entries.data + node->entries.len;
+            s += strlen (s + 1) + 2, ++i)
+    {
+        entry_info_t *info = &node->infos[i];
+    
+        info->skip = pool->walk->filter
+            && !filter_match (pool->walk->filter, s + 1);
+        /* no need to stat what won't be sent, unless we need the type */
+        if (info->skip && *s != 0)
+        {
+            info->has_st = FALSE;
+            info->type = (GFileTest) *s;
+        }
+        else
+        {
+            info->has_st = fstatat (fd, s + 1, &info->st, AT_SYMLINK_NOFOLLOW) == 0;
+            info->type = (info->has_st) ? get_file_type (info->st.st_mode)
+                : (GFileTest) *s;
+        }
+    
+        if (info->type == G_FILE_TEST_IS_DIR && (pool->walk->max_depth < 0
+                    || node->depth < pool->walk->max_depth))
+        {
+            g_string_append_c (path, '/');
+            g_string_append (path, s + 1);
+            node->subdirs[node->nb_subdirs++] = node_new (path->str, node);
+            g_string_truncate (path, strlen (node->path));
+        }
+    }
+    g_string_free (path, TRUE);
+    
+    if (node->nb_subdirs > 0)
+    {
+        g_mutex_lock (&pool->mutex);
+        /* pushed in reverse order, so the owner (popping from the tail) goes
+         * through them in order, i.e. as they'll be needed */
+        for (i = node->nb_subdirs; i > 0; --i)
+        {
+            node->subdirs[i - 1]->deque = deque;
+            g_queue_push_tail_link (&pool->deques[deque],
+                                    &node->subdirs[i - 1]->link);
+        }
+        pool->queued += node->nb_subdirs;
+        g_cond_broadcast (&pool->cond);
+        g_mutex_unlock (&pool->mutex);
+    }
+}
+
+/* returns a node to read, from our own deque or stolen from another one. Must
+ * be called with the lock held */
+static node_t *
+take_node (pool_t *pool, guint id)
+{
+    GList *link;
+    guint  i;
+    
+    link = g_queue_pop_tail_link (&pool->deques[id]);
+    for (i = 1; !link && i <= pool->nb_threads; ++i)
+    {
+        link = g_queue_pop_head_link (
+                &pool->deques[(id + i) % (pool->nb_threads + 1)]);
+    }
+    return (link) ? link->data : NULL;
+}
+
+typedef struct {
+    pool_t *pool;
+    guint   id;
+} worker_t;
+
+static gpointer
+worker (gpointer data)
+{
+    worker_t *w = data;
+    pool_t   *pool = w->pool;
+    node_t   *node;
+    gchar    *buf;
+    
+    buf = g_malloc (DENTS_BUF_SIZE);
+    g_mutex_lock (&pool->mutex);
+    for (;;)
+    {
+        while (!pool->done && (pool->queued == 0 || pool->pending >= pool->max_pending))
+        {
+            g_cond_wait (&pool->cond, &pool->mutex);
+        }
+        if (pool->done)
+        {
+            break;
+        }
+    
+        node = take_node (pool, w->id);
+        node->state = NODE_BUSY;
+        --pool->queued;
+        ++pool->pending;
+        g_mutex_unlock (&pool->mutex);
+    
+        read_node (pool, node, w->id, buf);
+    
+        g_mutex_lock (&pool->mutex);
+        node->state = NODE_READ;
+        g_cond_broadcast (&pool->cond);
+    }
+    g_mutex_unlock (&pool->mutex);
+    g_free (buf);
+    return NULL;
+}
+
+/* sends everything in node (subdirectories first), reading it ourself if no
+ * thread got to it yet. Frees the node */
+static void
+send_node (pool_t *pool, node_t *node, gchar *buf)
+{
+    GString *path;
+    gchar   *s;
+    gsize    len;
+    guint    i;
+    
+    g_mutex_lock (&pool->mutex);
+    if (node->state == NODE_NEW)
+    {
+        g_queue_unlink (&pool->deques[node->deque], &node->link);
+        node->state = NODE_BUSY;
+        --pool->queued;
+        ++pool->pending;
+        g_mutex_unlock (&pool->mutex);
+    
+        read_node (pool, node, pool->nb_threads, buf);
+    
+        g_mutex_lock (&pool->mutex);
+        node->state = NODE_READ;
+    }
+    while (node->state != NODE_READ)
+    {
+        g_cond_wait (&pool->cond, &pool->mutex);
+    }
+    g_mutex_unlock (&pool->mutex);
+    
+    if (node->error)
+    {
+        pool->walk->error (node->path, node->error, pool->walk->data);
+    }
+    else
+    {
+        for (i = 0; i < node->nb_subdirs; ++i)
+        {
+            send_node (pool, node->subdirs[i], buf);
+        }
+    
+        path = g_string_new (node->path);
+        len = path->len;
+        for (i = 0, s = node->entries.data;
+                s < node->entries.data + node->entries.len;
+                s += strlen (s) + 1, ++i)
+        {
+            entry_info_t *info = &node->infos[i];
+    
+            ++s;
+            if (info->skip)
+            {
+                continue;
+            }
+            g_string_append_c (path, '/');
+            g_string_append (path, s);
+            pool->walk->entry (node->fd, path->str, path->str + len + 1,
+                               info->type, (info->has_st) ? &info->st : NULL,
+                               pool->walk->data);
+            g_string_truncate (path, len);
+        }
+        g_string_free (path, TRUE);
+    }
+    
+    g_mutex_lock (&pool->mutex);
+    --pool->pending;
+    g_cond_broadcast (&pool->cond);
+    g_mutex_unlock (&pool->mutex);
+    node_free (node);
+}
+
+static void
+walk_parallel (walk_t *walk, gint fd, const gchar *path)
+{
+    pool_t    pool;
+    worker_t *workers;
+    GThread **threads;
+    node_t   *root;
+    gchar    *buf;
+    guint     i;
+    struct rlimit rl;
+    
+    pool.walk = walk;
+    g_mutex_init (&pool.mutex);
+    g_cond_init (&pool.cond);
+    pool.nb_threads = walk->jobs;
+    pool.deques = g_new (GQueue, pool.nb_threads + 1);
+    for (i = 0; i <= pool.nb_threads; ++i)
+    {
+        g_queue_init (&pool.deques[i]);
+    }
+    pool.queued = 0;
+    pool.pending = 0;
+    pool.max_pending = MAX_PENDING;
+    /* leave room for the fds of the serial walk of other arguments, etc */
+    if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+    {
+        pool.max_pending = (guint) CLAMP (rl.rlim_cur / 2, 1, MAX_PENDING);
+    }
+    pool.done = FALSE;
+    
+    workers = g_new (worker_t, pool.nb_threads);
+    threads = g_new (GThread *, pool.nb_threads);
+    for (i = 0; i < pool.nb_threads; ++i)
+    {
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        threads[i] = g_thread_new ("walk", worker, &workers[i]);
+    }
+    
+    root = node_new (path, NULL);
+    root->fd = fd;
+    buf = g_malloc (DENTS_BUF_SIZE);
+    /* root is NODE_NEW but in no deque: we read it ourself */
+    root->state = NODE_BUSY;
+    ++pool.pending;
+    read_node (&pool, root, pool.nb_threads, buf);
+    root->state = NODE_READ;
+    send_node (&pool, root, buf);
+    g_free (buf);
+    
+    g_mutex_lock (&pool.mutex);
+    pool.done = TRUE;
+    g_cond_broadcast (&pool.cond);
+    g_mutex_unlock (&pool.mutex);
+    for (i = 0; i < pool.nb_threads; ++i)
+    {
+        g_thread_join (threads[i]);
+    }
+    
+    g_free (threads);
+    g_free (workers);
+    g_free (pool.deques);
+    g_mutex_clear (&pool.mutex);
+    g_cond_clear (&pool.cond);
+}
+
+/* walks directory path, calling walk->entry for each file found inside (but
+ * not path itself), going through subdirectories up to walk->max_depth
+ * levels deep. Everything inside a directory is sent before the directory.
+ * With walk->jobs > 1, directories are read using that many threads, but
+ * entries are still sent from the calling thread, in the same order.
+ * On error, its code is the errno value (e.g. ENOTDIR) */
+gboolean
+walk_tree (walk_t *walk, const gchar *path, GError **error)
+{
+    GString *str;
+    gchar   *buf;
+    gint     fd;
+    
+    fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        g_set_error (error, MOLT_WALK_ERROR, errno, "%s", strerror (errno));
+        return FALSE;
+    }
+    
+    str = g_string_new (path);
+    /* avoid double slashes in the names we'll send */
+    while (str->len > 1 && str->str[str->len - 1] == '/')
+    {
+        g_string_truncate (str, str->len - 1);
+    }
+    if (str->len == 1 && str->str[0] == '/')
+    {
+        g_string_truncate (str, 0);
+    }
+    
+    if (walk->max_depth != 0 && walk->jobs > 1)
+    {
+        walk_parallel (walk, fd, str->str);
+    }
+    else if (walk->max_depth != 0)
+    {
+        buf = g_malloc (DENTS_BUF_SIZE);
+        walk_dir (walk, fd, str, 1, buf);
+        g_free (buf);
+    }
+    
+    close (fd);
+    g_string_free (str, TRUE);
+    return TRUE;
+}
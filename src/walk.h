@@ -0,0 +1,78 @@
+/**
+ * molt - Copyright (C) 2012 Olivier Brunel
+ *
+ * walk.h
+ * Copyright (C) 2012 Olivier Brunel <i.am.jack.mail@gmail.com>
+ *
+ * This file is part of molt.
+ *
+ * molt is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * molt is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * molt. If not, see http://www.gnu.org/licenses/
+ */
+
+#ifndef WALK_H
+#define	WALK_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/* C */
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* glib */
+#include <glib-2.0/glib.h>
+
+/* molt */
+#include "filter.h"
+
+#define MOLT_WALK_ERROR     g_quark_from_static_string ("molt walk error")
+
+/* function called for each entry found while walking a directory. type is
+ * one of G_FILE_TEST_IS_{REGULAR,DIR,SYMLINK}, G_FILE_TEST_EXISTS for any
+ * other type of file, or 0 if unknown. dirfd is the directory's, name being
+ * relative to it. st is the result of lstat() on the entry if already done,
+ * else NULL */
+typedef void (*walk_entry_fn) (gint         dirfd,
+                               gchar       *file,
+                               const gchar *name,
+                               GFileTest    type,
+                               struct stat *st,
+                               gpointer     data);
+
+/* function called when (sub)directory could not be read */
+typedef void (*walk_error_fn) (const gchar *path,
+                               const gchar *message,
+                               gpointer     data);
+
+typedef struct {
+    gint            max_depth;  /* max levels to descend into, -1 for no limit */
+    guint           jobs;       /* threads reading directories, 0 or 1 for none */
+    filter_t       *filter;     /* if set, only entries it matches are sent */
+    walk_entry_fn   entry;
+    walk_error_fn   error;
+    gpointer        data;
+} walk_t;
+
+GFileTest
+get_file_type (mode_t mode);
+
+gboolean
+walk_tree (walk_t *walk, const gchar *path, GError **error);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WALK_H */